@@ -4,7 +4,11 @@ rm -f vtoydump*
 
 machine=$(uname -m)
 
-gcc -Wall -std=gnu99 -DHAVE_CONFIG_H  -O2 -D_FILE_OFFSET_BITS=64 ./src/vtoydump_linux.c ./src/libexfat/*.c -I ./src -I ./src/libexfat -o vtoydump
+# the FAT fallback only reads through the fat_access layer
+FATSRC="./src/fat_io_lib/fat_access.c ./src/fat_io_lib/fat_cache.c ./src/fat_io_lib/fat_misc.c ./src/fat_io_lib/fat_string.c ./src/fat_io_lib/fat_table.c"
+FATOPT="-DFATFS_INC_WRITE_SUPPORT=0 -DFATFS_INC_FORMAT_SUPPORT=0 -DFATFS_DIR_LIST_SUPPORT=0 -DFAT_BUFFER_SECTORS=128 -DFAT_INLINE=inline"
+
+gcc -Wall -std=gnu99 -DHAVE_CONFIG_H $FATOPT -O2 -D_FILE_OFFSET_BITS=64 ./src/vtoydump_linux.c ./src/vtoyhash.c ./src/vtoyloc.c ./src/libexfat/*.c $FATSRC ./src/libntfs/*.c ./src/libextfs/*.c ./src/libxfs/*.c -I ./src -I ./src/libexfat -I ./src/fat_io_lib -I ./src/libntfs -I ./src/libextfs -I ./src/libxfs -o vtoydump -lpthread
 
 if [ -e vtoydump ]; then
     strip vtoydump
@@ -70,20 +70,56 @@ static uint32_t bytes2clusters(const struct exfat* ef, uint64_t bytes)
 	return DIV_ROUND_UP(bytes, cluster_size);
 }
 
+/*
+ * Read FAT entry of the cluster. If the FAT window is enabled, the entry is
+ * taken from memory and the window is refilled with one large aligned read
+ * when the entry is outside of it.
+ */
+static int read_fat_entry(const struct exfat* ef, cluster_t cluster,
+		le32_t* next)
+{
+	struct exfat_fat_window* fw = ef->fat_window;
+	const off_t fat_start = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start));
+	const off_t fat_end = fat_start +
+		s2o(ef, le32_to_cpu(ef->sb->fat_sector_count));
+	const off_t fat_offset = fat_start + (off_t) cluster * sizeof(cluster_t);
+
+	if (fw == NULL || fat_offset + sizeof(le32_t) > fat_end)
+	{
+		if (exfat_pread(ef->dev, next, sizeof(le32_t), fat_offset) < 0)
+			return -EIO;
+		return 0;
+	}
+
+	if (fw->size != 0 && fat_offset >= fw->offset &&
+			fat_offset + sizeof(le32_t) <= fw->offset + fw->size)
+		fw->saved++;
+	else
+	{
+		fw->offset = fat_start +
+			(fat_offset - fat_start) / fw->capacity * fw->capacity;
+		fw->size = MIN(fw->capacity, fat_end - fw->offset);
+		if (exfat_pread(ef->dev, fw->entries, fw->size, fw->offset) < 0)
+		{
+			fw->size = 0;
+			return -EIO;
+		}
+	}
+	*next = fw->entries[(fat_offset - fw->offset) / sizeof(le32_t)];
+	return 0;
+}
+
 cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster)
 {
 	le32_t next;
-	off_t fat_offset;
 
 	if (cluster < EXFAT_FIRST_DATA_CLUSTER)
 		exfat_bug("bad cluster 0x%x", cluster);
 
 	if (node->is_contiguous)
 		return cluster + 1;
-	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ cluster * sizeof(cluster_t);
-	if (exfat_pread(ef->dev, &next, sizeof(next), fat_offset) < 0)
+	if (read_fat_entry(ef, cluster, &next) != 0)
 		return EXFAT_CLUSTER_BAD; /* the caller should handle this and print
 		                             appropriate error message */
 	return le32_to_cpu(next);
@@ -111,29 +147,161 @@ cluster_t exfat_advance_cluster(const struct exfat* ef,
 	return node->fptr_cluster;
 }
 
-static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+void exfat_open_runs(const struct exfat* ef, const struct exfat_node* node,
+		struct exfat_run_iterator* it)
+{
+	it->node = node;
+	it->cluster = node->start_cluster;
+	it->remaining = bytes2clusters(ef, node->size);
+}
+
+/*
+ * Return the next run of adjacent clusters of the node. A contiguous node
+ * is returned as a single run without touching the FAT.
+ */
+int exfat_next_run(const struct exfat* ef, struct exfat_run_iterator* it,
+		cluster_t* start, uint32_t* count)
+{
+	cluster_t next = EXFAT_CLUSTER_END;
+
+	if (it->remaining == 0)
+		return -ENOENT;
+	if (CLUSTER_INVALID(*ef->sb, it->cluster))
+	{
+		exfat_error("invalid cluster 0x%x in run", it->cluster);
+		return -EIO;
+	}
+
+	*start = it->cluster;
+	if (it->node->is_contiguous)
+	{
+		*count = it->remaining;
+		if (CLUSTER_INVALID(*ef->sb, *start + *count - 1))
+		{
+			exfat_error("contiguous run 0x%x+%u is out of range", *start,
+					*count);
+			return -EIO;
+		}
+		it->remaining = 0;
+		return 0;
+	}
+
+	for (*count = 1; *count < it->remaining; (*count)++)
+	{
+		next = exfat_next_cluster(ef, it->node, *start + *count - 1);
+		if (next != *start + *count)
+			break;
+	}
+	it->remaining -= *count;
+	if (it->remaining != 0)
+		it->cluster = next;
+	return 0;
+}
+
+/*
+ * Read clusters bitmap into memory if it is not there yet. Its location
+ * must be already known from the root directory.
+ */
+int exfat_load_bitmap(struct exfat* ef)
+{
+	if (ef->cmap.chunk != NULL)
+		return 0;
+
+	ef->cmap.chunk_size = ef->cmap.size;
+	ef->cmap.chunk = malloc(BMAP_SIZE(ef->cmap.chunk_size));
+	if (ef->cmap.chunk == NULL)
+	{
+		exfat_error("failed to allocate clusters bitmap chunk "
+				"(%zu bytes)", BMAP_SIZE(ef->cmap.chunk_size));
+		return -ENOMEM;
+	}
+
+	if (exfat_pread(ef->dev, ef->cmap.chunk,
+			BMAP_SIZE(ef->cmap.chunk_size),
+			exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
+	{
+		exfat_error("failed to read clusters bitmap "
+				"(%zu bytes starting at cluster %#x)",
+				BMAP_SIZE(ef->cmap.chunk_size), ef->cmap.start_cluster);
+		free(ef->cmap.chunk);
+		ef->cmap.chunk = NULL;
+		return -EIO;
+	}
+	return 0;
+}
+
+#define BMAP_BITS (sizeof(bitmap_t) * 8)
+#define BMAP_ALL ((bitmap_t) ~(bitmap_t) 0)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define bmap_popcount(w) ((size_t) __builtin_popcountll(w))
+#define bmap_ctz(w) ((size_t) __builtin_ctzll(w))
+#else
+static size_t bmap_popcount(bitmap_t w)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
+	size_t count = 0;
+
+	for (; w != 0; w &= w - 1)
+		count++;
+	return count;
+}
+
+static size_t bmap_ctz(bitmap_t w)
+{
+	size_t count = 0;
+
+	for (; (w & 1) == 0; w >>= 1)
+		count++;
+	return count;
+}
+#endif
+
+/*
+ * Mask of bits [start % BMAP_BITS, end) within the word that contains
+ * bit "start"; "end" must not be below that word.
+ */
+static bitmap_t word_mask(size_t start, size_t end)
+{
+	const size_t base = start - start % BMAP_BITS;
+	bitmap_t mask = BMAP_ALL << (start % BMAP_BITS);
+
+	if (end - base < BMAP_BITS)
+		mask &= ((bitmap_t) 1 << (end - base)) - 1;
+	return mask;
+}
+
+/*
+ * Returns index of the first bit in [start, end) that equals to "value"
+ * or "end" if there is no such bit. Scans a word at a time.
+ */
+static size_t find_bit(const bitmap_t* bitmap, size_t start, size_t end,
+		bool value)
+{
+	const bitmap_t invert = value ? 0 : BMAP_ALL;
 	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
-	size_t c;
+	bitmap_t word;
 
-	for (i = start_index; i < end_index; i++)
+	if (start >= end)
+		return end;
+	word = (bitmap[BMAP_BLOCK(start)] ^ invert) & word_mask(start, end);
+	for (i = start - start % BMAP_BITS; word == 0; )
 	{
-		if (bitmap[i] == ~((bitmap_t) 0))
-			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
-			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
-			}
+		i += BMAP_BITS;
+		if (i >= end)
+			return end;
+		word = (bitmap[BMAP_BLOCK(i)] ^ invert) & word_mask(i, end);
 	}
-	return EXFAT_CLUSTER_END;
+	return i + bmap_ctz(word);
+}
+
+static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+{
+	const size_t c = find_bit(bitmap, start, end, false);
+
+	if (c >= end)
+		return EXFAT_CLUSTER_END;
+	BMAP_SET(bitmap, c);
+	return c + EXFAT_FIRST_DATA_CLUSTER;
 }
 
 static int flush_nodes(struct exfat* ef, struct exfat_node* node)
@@ -176,6 +344,7 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 {
 	off_t fat_offset;
 	le32_t next_le32;
+	struct exfat_fat_window* fw;
 
 	if (contiguous)
 		return true;
@@ -188,6 +357,11 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 				current);
 		return false;
 	}
+	/* keep the FAT window coherent with the device */
+	fw = ef->fat_window;
+	if (fw != NULL && fw->size != 0 && fat_offset >= fw->offset &&
+			fat_offset + sizeof(next_le32) <= fw->offset + fw->size)
+		fw->entries[(fat_offset - fw->offset) / sizeof(le32_t)] = next_le32;
 	return true;
 }
 
@@ -416,6 +590,13 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	if (node->size == size)
 		return 0;
 
+	if (c1 != c2)
+	{
+		rc = exfat_load_bitmap(ef);
+		if (rc != 0)
+			return rc;
+	}
+
 	if (c1 < c2)
 		rc = grow_file(ef, node, c1, c2 - c1);
 	else if (c1 > c2)
@@ -437,15 +618,19 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	return 0;
 }
 
-uint32_t exfat_count_free_clusters(const struct exfat* ef)
+uint32_t exfat_count_free_clusters(struct exfat* ef)
 {
-	uint32_t free_clusters = 0;
-	uint32_t i;
+	size_t used_clusters = 0;
+	size_t i;
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
-	return free_clusters;
+	if (exfat_load_bitmap(ef) != 0)
+		return 0;
+	for (i = 0; i < ef->cmap.size / BMAP_BITS; i++)
+		used_clusters += bmap_popcount(ef->cmap.chunk[i]);
+	if (ef->cmap.size % BMAP_BITS)
+		used_clusters += bmap_popcount(ef->cmap.chunk[i] &
+				word_mask(i * BMAP_BITS, ef->cmap.size));
+	return ef->cmap.size - used_clusters;
 }
 
 static int find_used_clusters(const struct exfat* ef,
@@ -454,27 +639,30 @@ static int find_used_clusters(const struct exfat* ef,
 	const cluster_t end = le32_to_cpu(ef->sb->cluster_count);
 
 	/* find first used cluster */
-	for (*a = *b + 1; *a < end; (*a)++)
-		if (BMAP_GET(ef->cmap.chunk, *a - EXFAT_FIRST_DATA_CLUSTER))
-			break;
+	*a = *b + 1;
+	if (*a >= end)
+		return 1;
+	*a = find_bit(ef->cmap.chunk, *a - EXFAT_FIRST_DATA_CLUSTER,
+			end - EXFAT_FIRST_DATA_CLUSTER, true) + EXFAT_FIRST_DATA_CLUSTER;
 	if (*a >= end)
 		return 1;
 
 	/* find last contiguous used cluster */
-	for (*b = *a; *b < end; (*b)++)
-		if (BMAP_GET(ef->cmap.chunk, *b - EXFAT_FIRST_DATA_CLUSTER) == 0)
-		{
-			(*b)--;
-			break;
-		}
+	*b = find_bit(ef->cmap.chunk, *a - EXFAT_FIRST_DATA_CLUSTER,
+			end - EXFAT_FIRST_DATA_CLUSTER, false) + EXFAT_FIRST_DATA_CLUSTER;
+	if (*b < end)
+		(*b)--;
 
 	return 0;
 }
 
-int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b)
+int exfat_find_used_sectors(struct exfat* ef, off_t* a, off_t* b)
 {
 	cluster_t ca, cb;
 
+	if (exfat_load_bitmap(ef) != 0)
+		return 1;
+
 	if (*a == 0 && *b == 0)
 		ca = cb = EXFAT_FIRST_DATA_CLUSTER - 1;
 	else
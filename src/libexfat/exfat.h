@@ -73,25 +73,41 @@ STATIC_ASSERT(sizeof(off_t) == 8);
 
 struct exfat_node
 {
-	struct exfat_node* parent;
-	struct exfat_node* child;
+	/* fields read while searching a directory come first */
 	struct exfat_node* next;
-	struct exfat_node* prev;
-
-	int references;
-	uint32_t fptr_index;
-	cluster_t fptr_cluster;
-	off_t entry_offset;
+	struct exfat_node* child;
+	struct exfat_node* hash_next;	/* in the bucket of the parent index */
+	const le16_t* name;			/* interned, see struct exfat_name_chunk */
+	uint64_t size;
 	cluster_t start_cluster;
-	uint16_t attrib;
+	le16_t name_hash;			/* as stored in the directory entry */
+	uint8_t name_length;		/* in UTF-16 code units */
 	uint8_t continuations;
+	uint16_t attrib;
 	bool is_contiguous : 1;
 	bool is_cached : 1;
 	bool is_dirty : 1;
 	bool is_unlinked : 1;
-	uint64_t size;
+	bool is_searched : 1;
+
+	struct exfat_node* parent;
+	struct exfat_dir_index* index;	/* of the children, can be NULL */
+	struct exfat_node* prev;
+	int references;
+	uint32_t fptr_index;
+	cluster_t fptr_cluster;
+	off_t entry_offset;
 	time_t mtime, atime;
-	le16_t name[EXFAT_NAME_MAX + 1];
+};
+
+/* hash table over the children of a cached directory, see node.c */
+struct exfat_dir_index
+{
+	struct exfat_dir_index* prev;
+	struct exfat_dir_index* next;	/* all indexes of the mount are listed */
+	uint32_t size;				/* number of buckets, a power of 2 */
+	uint32_t count;				/* number of indexed children */
+	struct exfat_node* buckets[];
 };
 
 enum exfat_mode
@@ -103,6 +119,50 @@ enum exfat_mode
 
 struct exfat_dev;
 
+/* max number of requests passed to exfat_pread_batch() at once */
+#define EXFAT_IO_BATCH 16
+
+/* one read request of exfat_pread_batch() */
+struct exfat_io
+{
+	void* buffer;
+	size_t size;
+	off_t offset;
+};
+
+/* in-memory copy of a part of the FAT, used to follow cluster chains */
+struct exfat_fat_window
+{
+	le32_t* entries;
+	off_t offset;				/* absolute offset of the cached part */
+	size_t size;				/* in bytes, 0 if nothing is cached */
+	size_t capacity;			/* in bytes */
+	uint64_t saved;				/* FAT reads served from memory */
+};
+
+/*
+ * Block of node names. Each name is stored as its length followed by the
+ * UTF-16 characters and a terminating zero, node->name points to the
+ * characters. Names of freed nodes are kept on lists by length and reused,
+ * the chunks are freed together with the nodes on unmount.
+ */
+struct exfat_name_chunk
+{
+	struct exfat_name_chunk* next;
+	size_t size;				/* in le16_t */
+	size_t used;				/* in le16_t */
+	le16_t names[];
+};
+
+/* block of nodes handed out by allocate_node(), freed only on unmount */
+struct exfat_node_chunk
+{
+	struct exfat_node_chunk* next;
+	size_t count;				/* nodes in this chunk */
+	size_t used;				/* nodes handed out from this chunk */
+	struct exfat_node nodes[];
+};
+
 struct exfat
 {
 	struct exfat_dev* dev;
@@ -118,6 +178,16 @@ struct exfat
 		bool dirty;
 	}
 	cmap;
+	struct exfat_fat_window* fat_window;
+	struct
+	{
+		struct exfat_node_chunk* chunks;	/* the newest chunk first */
+		struct exfat_node* free;	/* released nodes linked by next */
+		struct exfat_name_chunk* names;	/* the newest chunk first */
+		le16_t* free_names[EXFAT_NAME_MAX + 1];	/* by name length */
+		struct exfat_dir_index* indexes;
+	}
+	nodes;
 	char label[EXFAT_UTF8_ENAME_BUFFER_MAX];
 	void* zero_cluster;
 	int dmask, fmask;
@@ -125,6 +195,7 @@ struct exfat
 	gid_t gid;
 	int ro;
 	bool noatime;
+	bool lookup;				/* load clusters bitmap on demand */
 	enum { EXFAT_REPAIR_NO, EXFAT_REPAIR_ASK, EXFAT_REPAIR_YES } repair;
 };
 
@@ -135,6 +206,14 @@ struct exfat_iterator
 	struct exfat_node* current;
 };
 
+/* iterator over runs of adjacent clusters of a node */
+struct exfat_run_iterator
+{
+	const struct exfat_node* node;
+	cluster_t cluster;			/* first cluster of the next run */
+	uint32_t remaining;			/* clusters not returned yet */
+};
+
 struct exfat_human_bytes
 {
 	uint64_t value;
@@ -152,6 +231,10 @@ void exfat_debug(const char* format, ...) PRINTF;
 struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode);
 int exfat_close(struct exfat_dev* dev);
 int exfat_fsync(struct exfat_dev* dev);
+int exfat_setup_cache(struct exfat_dev* dev, size_t block_size, size_t count);
+void exfat_get_cache_stats(const struct exfat_dev* dev, uint64_t* hits,
+		uint64_t* misses);
+int exfat_setup_uring(struct exfat_dev* dev, unsigned entries);
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev);
 off_t exfat_get_size(const struct exfat_dev* dev);
 off_t exfat_seek(struct exfat_dev* dev, off_t offset, int whence);
@@ -159,6 +242,8 @@ ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size);
 ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size);
 ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		off_t offset);
+int exfat_pread_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		size_t count);
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		off_t offset);
 ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
@@ -170,6 +255,7 @@ int exfat_opendir(struct exfat* ef, struct exfat_node* dir,
 		struct exfat_iterator* it);
 void exfat_closedir(struct exfat* ef, struct exfat_iterator* it);
 struct exfat_node* exfat_readdir(struct exfat_iterator* it);
+int exfat_compare_name(struct exfat* ef, const le16_t* a, const le16_t* b);
 int exfat_lookup(struct exfat* ef, struct exfat_node** node,
 		const char* path);
 int exfat_split(struct exfat* ef, struct exfat_node** parent,
@@ -180,12 +266,17 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster);
 cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
+void exfat_open_runs(const struct exfat* ef, const struct exfat_node* node,
+		struct exfat_run_iterator* it);
+int exfat_next_run(const struct exfat* ef, struct exfat_run_iterator* it,
+		cluster_t* start, uint32_t* count);
 int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
-uint32_t exfat_count_free_clusters(const struct exfat* ef);
-int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b);
+int exfat_load_bitmap(struct exfat* ef);
+uint32_t exfat_count_free_clusters(struct exfat* ef);
+int exfat_find_used_sectors(struct exfat* ef, off_t* a, off_t* b);
 
 void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
 		struct stat* stbuf);
@@ -212,7 +303,10 @@ struct exfat_node* exfat_get_node(struct exfat_node* node);
 void exfat_put_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node);
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir);
+int exfat_find_node(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node** node, const le16_t* name);
 void exfat_reset_cache(struct exfat* ef);
+void exfat_free_nodes(struct exfat* ef);
 int exfat_flush_node(struct exfat* ef, struct exfat_node* node);
 int exfat_unlink(struct exfat* ef, struct exfat_node* node);
 int exfat_rmdir(struct exfat* ef, struct exfat_node* node);
@@ -42,6 +42,56 @@
 #include <sys/uio.h>
 #include <ublio.h>
 #endif
+#if defined(__linux__) && !defined(USE_UBLIO) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+/* not defined by 5.1-5.3 headers, the kernel just does not report it */
+#ifndef IORING_FEAT_SINGLE_MMAP
+#define IORING_FEAT_SINGLE_MMAP (1U << 0)
+#endif
+#endif
+#endif
+#endif
+
+#ifdef USE_IO_URING
+/* io_uring instance used by exfat_pread_batch() */
+struct exfat_uring
+{
+	int fd;
+	unsigned entries;
+	void* sq_ptr;
+	size_t sq_size;
+	void* cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	struct iovec* iovecs;
+};
+#endif
+
+/* a block of the device cached in memory */
+struct exfat_block
+{
+	off_t offset;				/* block aligned, -1 if the block is unused */
+	size_t size;				/* valid bytes, less than block size at EOF */
+	struct exfat_block* hnext;	/* next block in the same hash bucket */
+	struct exfat_block* prev;	/* LRU list, head is the most recently used */
+	struct exfat_block* next;
+	char* data;
+};
 
 struct exfat_dev
 {
@@ -51,6 +101,23 @@ struct exfat_dev
 #ifdef USE_UBLIO
 	off_t pos;
 	ublio_filehandle_t ufh;
+#endif
+	struct
+	{
+		size_t block_size;		/* in bytes, 0 if the cache is disabled */
+		size_t count;			/* blocks count */
+		size_t hash_size;		/* buckets count, power of 2 */
+		struct exfat_block* blocks;
+		struct exfat_block** hash;
+		struct exfat_block* head;
+		struct exfat_block* tail;
+		char* data;
+		uint64_t hits;
+		uint64_t misses;
+	}
+	cache;
+#ifdef USE_IO_URING
+	struct exfat_uring* ring;
 #endif
 };
 
@@ -116,6 +183,10 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 		exfat_error("failed to allocate memory for device structure");
 		return NULL;
 	}
+	memset(&dev->cache, 0, sizeof(dev->cache));
+#ifdef USE_IO_URING
+	dev->ring = NULL;
+#endif
 
 	switch (mode)
 	{
@@ -267,6 +338,297 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 	return dev;
 }
 
+static struct exfat_block** hash_bucket(struct exfat_dev* dev, off_t offset)
+{
+	return dev->cache.hash + ((offset / dev->cache.block_size) &
+			(dev->cache.hash_size - 1));
+}
+
+static struct exfat_block* find_block(struct exfat_dev* dev, off_t offset)
+{
+	struct exfat_block* block;
+
+	for (block = *hash_bucket(dev, offset); block; block = block->hnext)
+		if (block->offset == offset)
+			return block;
+	return NULL;
+}
+
+static void unhash_block(struct exfat_dev* dev, struct exfat_block* block)
+{
+	struct exfat_block** p;
+
+	if (block->offset == -1)
+		return;
+	for (p = hash_bucket(dev, block->offset); *p; p = &(*p)->hnext)
+		if (*p == block)
+		{
+			*p = block->hnext;
+			break;
+		}
+	block->hnext = NULL;
+	block->offset = -1;
+}
+
+static void touch_block(struct exfat_dev* dev, struct exfat_block* block)
+{
+	if (dev->cache.head == block)
+		return;
+
+	/* unlink from the LRU list */
+	block->prev->next = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+	else
+		dev->cache.tail = block->prev;
+	/* and insert at the head */
+	block->prev = NULL;
+	block->next = dev->cache.head;
+	dev->cache.head->prev = block;
+	dev->cache.head = block;
+}
+
+static void free_cache(struct exfat_dev* dev)
+{
+	free(dev->cache.data);
+	free(dev->cache.hash);
+	free(dev->cache.blocks);
+	memset(&dev->cache, 0, sizeof(dev->cache));
+}
+
+/*
+ * Set up the block cache in front of exfat_pread() and exfat_pwrite().
+ * Block size must be a power of 2. Zero block size or count disables
+ * the cache.
+ */
+int exfat_setup_cache(struct exfat_dev* dev, size_t block_size, size_t count)
+{
+	size_t i;
+
+	free_cache(dev);
+	if (block_size == 0 || count == 0)
+		return 0;
+	if (block_size & (block_size - 1))
+	{
+		exfat_error("cache block size %zu is not a power of 2", block_size);
+		return -EINVAL;
+	}
+
+	dev->cache.hash_size = 1;
+	while (dev->cache.hash_size < count * 2)
+		dev->cache.hash_size *= 2;
+	dev->cache.blocks = calloc(count, sizeof(struct exfat_block));
+	dev->cache.hash = calloc(dev->cache.hash_size,
+			sizeof(struct exfat_block*));
+	dev->cache.data = malloc(block_size * count);
+	if (dev->cache.blocks == NULL || dev->cache.hash == NULL ||
+			dev->cache.data == NULL)
+	{
+		free_cache(dev);
+		exfat_error("failed to allocate block cache (%zu x %zu bytes)",
+				count, block_size);
+		return -ENOMEM;
+	}
+
+	dev->cache.block_size = block_size;
+	dev->cache.count = count;
+	for (i = 0; i < count; i++)
+	{
+		struct exfat_block* block = dev->cache.blocks + i;
+
+		block->offset = -1;
+		block->data = dev->cache.data + i * block_size;
+		block->prev = i > 0 ? block - 1 : NULL;
+		block->next = i + 1 < count ? block + 1 : NULL;
+	}
+	dev->cache.head = dev->cache.blocks;
+	dev->cache.tail = dev->cache.blocks + count - 1;
+	return 0;
+}
+
+void exfat_get_cache_stats(const struct exfat_dev* dev, uint64_t* hits,
+		uint64_t* misses)
+{
+	*hits = dev->cache.hits;
+	*misses = dev->cache.misses;
+}
+
+#ifdef USE_IO_URING
+static void free_uring(struct exfat_dev* dev)
+{
+	struct exfat_uring* ring = dev->ring;
+
+	if (ring == NULL)
+		return;
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+	free(ring->iovecs);
+	free(ring);
+	dev->ring = NULL;
+}
+
+static int init_uring(struct exfat_dev* dev, unsigned entries)
+{
+	struct io_uring_params p;
+	struct exfat_uring* ring;
+
+	ring = malloc(sizeof(struct exfat_uring));
+	if (ring == NULL)
+		return -ENOMEM;
+	memset(ring, 0, sizeof(struct exfat_uring));
+	ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+	{
+		free(ring);
+		return -errno;
+	}
+	dev->ring = ring;
+	ring->entries = p.sq_entries;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		return -errno;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			return -errno;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return -errno;
+	ring->iovecs = calloc(p.sq_entries, sizeof(struct iovec));
+	if (ring->iovecs == NULL)
+		return -ENOMEM;
+
+	ring->sq_head = (unsigned*) ((char*) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned*) ((char*) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) ((char*) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) ((char*) ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (unsigned*) ((char*) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned*) ((char*) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) ((char*) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) ((char*) ring->cq_ptr +
+			p.cq_off.cqes);
+	return 0;
+}
+
+/*
+ * Submit up to ring->entries reads and wait for all of them.
+ */
+static int uring_read(struct exfat_dev* dev, const struct exfat_io* ios,
+		unsigned count)
+{
+	struct exfat_uring* ring = dev->ring;
+	struct io_uring_cqe* cqe;
+	unsigned tail = *ring->sq_tail;
+	unsigned head;
+	unsigned submitted = 0;
+	unsigned done = 0;
+	unsigned i;
+	long ret;
+	int rc = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		unsigned index = (tail + i) & *ring->sq_mask;
+		struct io_uring_sqe* sqe = ring->sqes + index;
+
+		ring->iovecs[i].iov_base = ios[i].buffer;
+		ring->iovecs[i].iov_len = ios[i].size;
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = dev->fd;
+		sqe->addr = (unsigned long) &ring->iovecs[i];
+		sqe->len = 1;
+		sqe->off = ios[i].offset;
+		sqe->user_data = i;
+		ring->sq_array[index] = index;
+	}
+	__atomic_store_n(ring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+	/* the kernel can take fewer entries than asked, submit the rest again */
+	while (submitted < count)
+	{
+		ret = syscall(__NR_io_uring_enter, ring->fd, count - submitted, 0,
+				0, NULL, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			/* the caller drops the ring with the entries left in it, but
+			   the submitted ones still write to the buffers */
+			rc = ret < 0 ? -errno : -EAGAIN;
+			break;
+		}
+		submitted += ret;
+	}
+
+	while (done < submitted)
+	{
+		head = *ring->cq_head;
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			/* the rest is not completed yet */
+			if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+					IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+				return -errno;
+			continue;
+		}
+		cqe = ring->cqes + (head & *ring->cq_mask);
+		/* a short read fails the batch, as it does without io_uring */
+		if ((cqe->user_data >= count || cqe->res < 0 ||
+				(size_t) cqe->res != ios[cqe->user_data].size) && rc == 0)
+			rc = -EIO;
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		done++;
+	}
+	return rc;
+}
+#endif
+
+/*
+ * Use io_uring with the given queue depth for exfat_pread_batch(). If
+ * io_uring is not available the batch falls back to exfat_pread().
+ */
+int exfat_setup_uring(struct exfat_dev* dev, unsigned entries)
+{
+#ifdef USE_IO_URING
+	int rc;
+
+	free_uring(dev);
+	if (entries == 0)
+		return 0;
+	rc = init_uring(dev, entries);
+	if (rc != 0)
+	{
+		free_uring(dev);
+		if (rc != -ENOSYS && rc != -EPERM)
+			exfat_warn("io_uring is not available: %s", strerror(-rc));
+	}
+#endif
+	return 0;
+}
+
 int exfat_close(struct exfat_dev* dev)
 {
 	int rc = 0;
@@ -283,6 +645,10 @@ int exfat_close(struct exfat_dev* dev)
 		exfat_error("failed to close device: %s", strerror(errno));
 		rc = -EIO;
 	}
+	free_cache(dev);
+#ifdef USE_IO_URING
+	free_uring(dev);
+#endif
 	free(dev);
 	return rc;
 }
@@ -340,6 +706,14 @@ ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size)
 
 ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 {
+	/* position based writes are rare, simply drop cached blocks */
+	if (dev->cache.block_size != 0)
+	{
+		size_t i;
+
+		for (i = 0; i < dev->cache.count; i++)
+			unhash_block(dev, dev->cache.blocks + i);
+	}
 #ifdef USE_UBLIO
 	ssize_t result = ublio_pwrite(dev->ufh, buffer, size, dev->pos);
 	if (result >= 0)
@@ -350,7 +724,7 @@ ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 #endif
 }
 
-ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
+static ssize_t raw_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		off_t offset)
 {
 #ifdef USE_UBLIO
@@ -360,8 +734,8 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 #endif
 }
 
-ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
-		off_t offset)
+static ssize_t raw_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, off_t offset)
 {
 #ifdef USE_UBLIO
 	return ublio_pwrite(dev->ufh, buffer, size, offset);
@@ -370,12 +744,157 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 #endif
 }
 
+/*
+ * Return the cached block at the (aligned) offset, reading it from the
+ * device and evicting the least recently used one if necessary.
+ */
+static struct exfat_block* get_block(struct exfat_dev* dev, off_t offset)
+{
+	struct exfat_block* block = find_block(dev, offset);
+	struct exfat_block** bucket;
+	ssize_t size;
+
+	if (block != NULL)
+	{
+		dev->cache.hits++;
+		touch_block(dev, block);
+		return block;
+	}
+
+	dev->cache.misses++;
+	block = dev->cache.tail;
+	unhash_block(dev, block);
+	size = raw_pread(dev, block->data, dev->cache.block_size, offset);
+	if (size < 0)
+		return NULL;
+	block->offset = offset;
+	block->size = size;
+	bucket = hash_bucket(dev, offset);
+	block->hnext = *bucket;
+	*bucket = block;
+	touch_block(dev, block);
+	return block;
+}
+
+static ssize_t cached_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		off_t offset)
+{
+	char* bufp = buffer;
+	size_t done = 0;
+
+	while (done < size)
+	{
+		off_t current = offset + done;
+		off_t block_offset = current & ~((off_t) dev->cache.block_size - 1);
+		size_t skip = current - block_offset;
+		struct exfat_block* block = get_block(dev, block_offset);
+		size_t length;
+
+		if (block == NULL)
+			return -1;
+		if (block->size <= skip)
+			break;	/* end of the device */
+		length = MIN(block->size - skip, size - done);
+		memcpy(bufp + done, block->data + skip, length);
+		done += length;
+		if (block->size < dev->cache.block_size)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Write-through: cached blocks that overlap written data are updated.
+ */
+static void update_cache(struct exfat_dev* dev, const void* buffer,
+		size_t size, off_t offset)
+{
+	const char* bufp = buffer;
+	off_t block_offset = offset & ~((off_t) dev->cache.block_size - 1);
+
+	for (; block_offset < offset + (off_t) size;
+			block_offset += dev->cache.block_size)
+	{
+		struct exfat_block* block = find_block(dev, block_offset);
+		off_t begin, end;
+
+		if (block == NULL)
+			continue;
+		begin = MAX(offset, block_offset);
+		end = MIN(offset + (off_t) size,
+				block_offset + (off_t) dev->cache.block_size);
+		memcpy(block->data + (begin - block_offset), bufp + (begin - offset),
+				end - begin);
+		if ((size_t) (end - block_offset) > block->size)
+			block->size = end - block_offset;
+	}
+}
+
+ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		off_t offset)
+{
+	/* large reads bypass the cache */
+	if (dev->cache.block_size == 0 || size > dev->cache.block_size)
+		return raw_pread(dev, buffer, size, offset);
+	return cached_pread(dev, buffer, size, offset);
+}
+
+/*
+ * Read several independent parts of the device, keeping all of them in
+ * flight at once when io_uring is available.
+ */
+int exfat_pread_batch(struct exfat_dev* dev, const struct exfat_io* ios,
+		size_t count)
+{
+	size_t i;
+
+#ifdef USE_IO_URING
+	if (dev->ring != NULL && count > 1)
+	{
+		while (count > 0)
+		{
+			unsigned n = MIN(count, dev->ring->entries);
+			int rc = uring_read(dev, ios, n);
+
+			if (rc == -EIO)
+				return rc;
+			if (rc != 0)
+			{
+				/* the ring is broken, go on without it */
+				exfat_warn("io_uring failed: %s", strerror(-rc));
+				free_uring(dev);
+				break;
+			}
+			ios += n;
+			count -= n;
+		}
+	}
+#endif
+	for (i = 0; i < count; i++)
+		if (exfat_pread(dev, ios[i].buffer, ios[i].size, ios[i].offset) !=
+				(ssize_t) ios[i].size)
+			return -EIO;
+	return 0;
+}
+
+ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
+		off_t offset)
+{
+	ssize_t result = raw_pwrite(dev, buffer, size, offset);
+
+	if (result > 0 && dev->cache.block_size != 0)
+		update_cache(dev, buffer, result, offset);
+	return result;
+}
+
 ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, off_t offset)
 {
 	cluster_t cluster;
 	char* bufp = buffer;
 	off_t lsize, loffset, remainder;
+	struct exfat_io ios[EXFAT_IO_BATCH];
+	size_t count = 0;
 
 	if (offset >= node->size)
 		return 0;
@@ -399,17 +918,36 @@ ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
 			return -EIO;
 		}
 		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pread(ef->dev, bufp, lsize,
-					exfat_c2o(ef, cluster) + loffset) < 0)
+		/* adjacent clusters are read at once, fragments are batched */
+		if (count > 0 && ios[count - 1].offset + ios[count - 1].size ==
+				exfat_c2o(ef, cluster) + loffset)
+			ios[count - 1].size += lsize;
+		else
 		{
-			exfat_error("failed to read cluster %#x", cluster);
-			return -EIO;
+			if (count == EXFAT_IO_BATCH)
+			{
+				if (exfat_pread_batch(ef->dev, ios, count) != 0)
+				{
+					exfat_error("failed to read clusters before %#x", cluster);
+					return -EIO;
+				}
+				count = 0;
+			}
+			ios[count].buffer = bufp;
+			ios[count].size = lsize;
+			ios[count].offset = exfat_c2o(ef, cluster) + loffset;
+			count++;
 		}
 		bufp += lsize;
 		loffset = 0;
 		remainder -= lsize;
 		cluster = exfat_next_cluster(ef, node, cluster);
 	}
+	if (count > 0 && exfat_pread_batch(ef->dev, ios, count) != 0)
+	{
+		exfat_error("failed to read clusters before %#x", cluster);
+		return -EIO;
+	}
 	if (!(node->attrib & EXFAT_ATTRIB_DIR) && !ef->ro && !ef->noatime)
 		exfat_update_atime(node);
 	return MIN(size, node->size - offset) - remainder;
@@ -64,7 +64,7 @@ static int compare_char(struct exfat* ef, uint16_t a, uint16_t b)
 	return (int) ef->upcase[a] - (int) ef->upcase[b];
 }
 
-static int compare_name(struct exfat* ef, const le16_t* a, const le16_t* b)
+int exfat_compare_name(struct exfat* ef, const le16_t* a, const le16_t* b)
 {
 	while (le16_to_cpu(*a) && le16_to_cpu(*b))
 	{
@@ -80,7 +80,6 @@ static int compare_name(struct exfat* ef, const le16_t* a, const le16_t* b)
 static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 		struct exfat_node** node, const char* name, size_t n)
 {
-	struct exfat_iterator it;
 	le16_t buffer[EXFAT_NAME_MAX + 1];
 	int rc;
 
@@ -90,20 +89,14 @@ static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 	if (rc != 0)
 		return rc;
 
-	rc = exfat_opendir(ef, parent, &it);
-	if (rc != 0)
-		return rc;
-	while ((*node = exfat_readdir(&it)))
+	/* lookup-only mounts do not cache whole directories */
+	if (!ef->lookup)
 	{
-		if (compare_name(ef, buffer, (*node)->name) == 0)
-		{
-			exfat_closedir(ef, &it);
-			return 0;
-		}
-		exfat_put_node(ef, *node);
+		rc = exfat_cache_directory(ef, parent);
+		if (rc != 0)
+			return rc;
 	}
-	exfat_closedir(ef, &it);
-	return -ENOENT;
+	return exfat_find_node(ef, parent, node, buffer);
 }
 
 static size_t get_comp(const char* path, const char** comp)
@@ -25,174 +25,124 @@
 #include <errno.h>
 #include <unistd.h>
 #include <exfat.h>
-#include <vtoydump.h>
+#include <vtoyloc.h>
 
-static int g_image_max_region = 0;
-static ventoy_image_location *g_image_location = NULL;
-
-static int realloc_image_location(int max_region)
-{
-    size_t len;
-    ventoy_guid guid = VENTOY_GUID;
-    ventoy_image_location *new_location = NULL;
-
-    len = sizeof(ventoy_image_location) + sizeof(ventoy_image_disk_region) * (max_region - 1);
-    new_location = malloc(len);
-    if (!new_location)
-    {
-        return -1;
-    }
-
-    if (g_image_location)
-    {
-        len = sizeof(ventoy_image_location) + sizeof(ventoy_image_disk_region) * (g_image_max_region - 1);
-        memcpy(new_location, g_image_location, len);
-        free(g_image_location);
-    }
-    else
-    {
-        memcpy(&new_location->guid, &guid, sizeof(ventoy_guid));
-        new_location->image_sector_size = 2048;
-        new_location->disk_sector_size = 512;
-        new_location->region_count = 0;
-    }
-
-    g_image_location = new_location;
-    g_image_max_region = max_region;
-    
-    return 0;
-}
-
-static ssize_t exfat_add_disk_region(size_t size, off_t offset)
+static int exfat_get_image_location(struct exfat *ef, struct exfat_node *node,
+                                    ventoy_image_location **plocation)
 {
     int rc = 0;
-    off_t last_disk_sector_count = 0;
-    ventoy_image_disk_region *last_region = NULL;
-    ventoy_image_disk_region *cur_region = NULL;
-
-    if (size == 0)
-    {
-        return 0;
-    }
-
-    if (g_image_location->region_count == 0)
+    off_t left_size = 0;
+    off_t cur_size = 0;
+    cluster_t start;
+    uint32_t count;
+    uint32_t maxregion = 1024;
+    struct exfat_run_iterator it;
+    ventoy_image_location *location = NULL;
+
+    location = vtoy_alloc_location(maxregion);
+    if (!location)
     {
-        cur_region = g_image_location->regions;
-        cur_region->image_start_sector = 0;
-        cur_region->image_sector_count = size / 2048;
-        cur_region->disk_start_sector  = offset / 512;
-        g_image_location->region_count = 1;
-        return size;
+        return -ENOMEM;
     }
 
-    last_region = g_image_location->regions + g_image_location->region_count - 1;
-    last_disk_sector_count = (off_t)last_region->image_sector_count * 4;
-    
-    if (last_region->disk_start_sector + last_disk_sector_count == (offset / 512))
+    exfat_open_runs(ef, node, &it);
+    for (left_size = node->size; left_size > 0; left_size -= cur_size)
     {
-        last_region->image_sector_count += size / 2048;
-        return size;
-    }
-    
-    if (g_image_location->region_count == g_image_max_region)
-    {
-        rc = realloc_image_location(g_image_max_region * 2);
+        rc = exfat_next_run(ef, &it, &start, &count);
         if (rc)
         {
-            return -1;
+            exfat_error("failed to get cluster run of image %d", rc);
+            rc = -EIO;
+            break;
         }
 
-        /* must update last_region */
-        last_region = g_image_location->regions + g_image_location->region_count - 1;
-    }
-
-    cur_region = last_region + 1;
-    cur_region->image_start_sector = last_region->image_start_sector + last_region->image_sector_count;
-    cur_region->image_sector_count = size / 2048;
-    cur_region->disk_start_sector  = offset / 512;
-    
-    g_image_location->region_count++;
-
-    return size;
-}
-
-static int exfat_get_image_location(struct exfat *ef, struct exfat_node *node)
-{
-    off_t left_size = 0;
-	off_t cur_size = 0;
-    off_t cur_offset = 0;
-    off_t last_size = 0;
-    off_t last_offset = 0;
-	cluster_t cluster;
-
-    realloc_image_location(1024);
-
-	cluster = exfat_advance_cluster(ef, node, 0);
-	if (CLUSTER_INVALID(*ef->sb, cluster))
-	{
-		exfat_error("invalid cluster 0x%x", cluster);
-		return -EIO;
-	}
-
-	for (left_size = node->size; left_size > 0; left_size -= cur_size)
-	{
-		if (CLUSTER_INVALID(*ef->sb, cluster))
-		{
-			exfat_error("invalid cluster 0x%x while reading", cluster);
-			return -EIO;
-		}
-
-        cur_size = MIN(CLUSTER_SIZE(*ef->sb), left_size);
-        cur_offset = exfat_c2o(ef, cluster);
-
-        if (last_offset + last_size == cur_offset)
-        {
-            last_size += cur_size;
-        }
-        else
+        cur_size = MIN((off_t)count * CLUSTER_SIZE(*ef->sb), left_size);
+        if (vtoy_add_region(&location, &maxregion, cur_size, exfat_c2o(ef, start)))
         {
-            exfat_add_disk_region(last_size, last_offset);
-            last_size = cur_size;
-            last_offset = cur_offset;
+            rc = -ENOMEM;
+            break;
         }
+    }
 
-		cluster = exfat_next_cluster(ef, node, cluster);
-	}
-
-    exfat_add_disk_region(last_size, last_offset);
+    if (rc)
+    {
+        free(location);
+        return rc;
+    }
 
-	return 0;
+    *plocation = location;
+    return 0;
 }
 
-ventoy_image_location * ventoy_get_location_by_lsexfat(const char *diskname, int part, const char *filename)
+/*
+ * Mount the exfat partition once and get the location of every file.
+ * locations[i] is NULL if the i-th file can not be resolved.
+ * Return the count of files that failed.
+ */
+int ventoy_get_locations_by_lsexfat(const char *diskname, int part, int count,
+                                    const char **filenames, ventoy_image_location **locations)
 {
+    int i;
     int rc;
+    int failed = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
     char diskpart[128] = {0};
     struct exfat ef;
     struct exfat_node *node;
 
+    for (i = 0; i < count; i++)
+    {
+        locations[i] = NULL;
+    }
+
     snprintf(diskpart, sizeof(diskpart) - 1, "/dev/%s%d", diskname, part);
 
-    rc = exfat_mount(&ef, diskpart, "ro");
+    rc = exfat_mount(&ef, diskpart, "ro,lookup");
     if (rc)
     {
         fprintf(stderr, "Failed to mount exfat fs %d\n", rc);
-        return NULL;
+        return count;
     }
 
-    rc = exfat_lookup(&ef, &node, filename);
-    if (rc == 0)
+    /* directories resolved for one file stay attached and are reused by the next ones */
+    for (i = 0; i < count; i++)
     {
-        rc = exfat_get_image_location(&ef, node);
-        exfat_put_node(&ef, node);
+        rc = exfat_lookup(&ef, &node, filenames[i]);
+        if (rc == 0)
+        {
+            rc = exfat_get_image_location(&ef, node, locations + i);
+            exfat_put_node(&ef, node);
+        }
+        else
+        {
+            fprintf(stderr, "Failed to find %s in exfat fs %d\n", filenames[i], rc);
+        }
+
+        if (rc)
+        {
+            failed++;
+        }
     }
-    else
+
+    if (ef.fat_window)
     {
-        fprintf(stderr, "Failed to find %s in exfat fs %d\n", filename, rc);
+        debug("FAT window saved %llu reads\n", (unsigned long long)ef.fat_window->saved);
     }
 
+    exfat_get_cache_stats(ef.dev, &hits, &misses);
+    debug("block cache hits %llu misses %llu\n", (unsigned long long)hits, (unsigned long long)misses);
+
     exfat_unmount(&ef);
 
-    return rc ? NULL : g_image_location;
+    return failed;
 }
 
+ventoy_image_location * ventoy_get_location_by_lsexfat(const char *diskname, int part, const char *filename)
+{
+    ventoy_image_location *location = NULL;
+
+    ventoy_get_locations_by_lsexfat(diskname, part, 1, &filename, &location);
+
+    return location;
+}
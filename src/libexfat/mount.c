@@ -28,6 +28,11 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+/* limits of the block cache options */
+#define EXFAT_CACHE_BLOCK_MAX_KB 4096
+#define EXFAT_CACHE_BLOCKS_MAX 4096
+#define EXFAT_CACHE_MAX_KB (256 * 1024)
+
 static uint64_t rootdir_size(const struct exfat* ef)
 {
 	uint32_t clusters = 0;
@@ -79,6 +84,28 @@ static int get_int_option(const char* options, const char* option_name,
 	return strtol(p, NULL, base);
 }
 
+/* like get_int_option() but the whole value must be a number in [min, max] */
+static int get_ranged_option(const char* options, const char* option_name,
+		long min, long max, long default_value, long* value)
+{
+	const char* p = get_option(options, option_name);
+	char* end;
+
+	*value = default_value;
+	if (p == NULL)
+		return 0;
+	errno = 0;
+	*value = strtol(p, &end, 10);
+	if (errno != 0 || end == p || (*end != ',' && *end != '\0') ||
+			*value < min || *value > max)
+	{
+		exfat_error("invalid %s value, expected %ld to %ld", option_name,
+				min, max);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 static bool match_option(const char* options, const char* option_name)
 {
 	const char* p;
@@ -103,6 +130,7 @@ static void parse_options(struct exfat* ef, const char* options)
 	ef->gid = get_int_option(options, "gid", 10, getegid());
 
 	ef->noatime = match_option(options, "noatime");
+	ef->lookup = match_option(options, "lookup");
 
 	switch (get_int_option(options, "repair", 10, 0))
 	{
@@ -118,6 +146,36 @@ static void parse_options(struct exfat* ef, const char* options)
 	}
 }
 
+static int init_fat_window(struct exfat* ef, const char* options)
+{
+	/* FAT window size in KB, 0 disables it */
+	int window_kb = get_int_option(options, "fat_window", 10, 1024);
+	off_t fat_size = (off_t) le32_to_cpu(ef->sb->fat_sector_count) *
+		SECTOR_SIZE(*ef->sb);
+
+	if (window_kb <= 0 || fat_size == 0)
+		return 0;
+
+	ef->fat_window = malloc(sizeof(struct exfat_fat_window));
+	if (ef->fat_window == NULL)
+	{
+		exfat_error("failed to allocate FAT window");
+		return -ENOMEM;
+	}
+	memset(ef->fat_window, 0, sizeof(struct exfat_fat_window));
+	ef->fat_window->capacity = MIN((off_t) window_kb * 1024, fat_size);
+	ef->fat_window->entries = malloc(ef->fat_window->capacity);
+	if (ef->fat_window->entries == NULL)
+	{
+		exfat_error("failed to allocate FAT window (%zu bytes)",
+				ef->fat_window->capacity);
+		free(ef->fat_window);
+		ef->fat_window = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 static bool verify_vbr_checksum(const struct exfat* ef, void* sector)
 {
 	off_t sector_size = SECTOR_SIZE(*ef->sb);
@@ -179,16 +237,24 @@ static int prepare_super_block(const struct exfat* ef)
 	return commit_super_block(ef);
 }
 
+/* the root directory has no name */
+static const le16_t root_name[1];
+
 static void exfat_free(struct exfat* ef)
 {
 	exfat_close(ef->dev);	/* first of all, close the descriptor */
 	ef->dev = NULL;			/* struct exfat_dev is freed by exfat_close() */
 	free(ef->root);
 	ef->root = NULL;
+	exfat_free_nodes(ef);
 	free(ef->zero_cluster);
 	ef->zero_cluster = NULL;
 	free(ef->cmap.chunk);
 	ef->cmap.chunk = NULL;
+	if (ef->fat_window != NULL)
+		free(ef->fat_window->entries);
+	free(ef->fat_window);
+	ef->fat_window = NULL;
 	free(ef->upcase);
 	ef->upcase = NULL;
 	free(ef->sb);
@@ -198,6 +264,8 @@ static void exfat_free(struct exfat* ef)
 int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 {
 	int rc;
+	long cache_block;
+	long cache_blocks;
 	enum exfat_mode mode;
 
 	exfat_tzset();
@@ -211,9 +279,35 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		mode = EXFAT_MODE_ANY;
 	else
 		mode = EXFAT_MODE_RW;
+	/* block cache: cache_block in KB, cache_blocks=0 disables it */
+	rc = get_ranged_option(options, "cache_block", 1, EXFAT_CACHE_BLOCK_MAX_KB,
+			64, &cache_block);
+	if (rc != 0)
+		return rc;
+	rc = get_ranged_option(options, "cache_blocks", 0, EXFAT_CACHE_BLOCKS_MAX,
+			32, &cache_blocks);
+	if (rc != 0)
+		return rc;
+	if (cache_block * cache_blocks > EXFAT_CACHE_MAX_KB)
+	{
+		exfat_error("block cache of %ld KB is larger than %d KB",
+				cache_block * cache_blocks, EXFAT_CACHE_MAX_KB);
+		return -EINVAL;
+	}
+
 	ef->dev = exfat_open(spec, mode);
 	if (ef->dev == NULL)
 		return -EIO;
+	rc = exfat_setup_cache(ef->dev, (size_t) cache_block * 1024,
+			(size_t) cache_blocks);
+	if (rc != 0)
+	{
+		exfat_close(ef->dev);
+		ef->dev = NULL;
+		return rc;
+	}
+	/* queue depth of batched reads, 0 disables io_uring */
+	exfat_setup_uring(ef->dev, get_int_option(options, "io_uring", 10, 32));
 	if (exfat_get_mode(ef->dev) == EXFAT_MODE_RO)
 	{
 		if (mode == EXFAT_MODE_ANY)
@@ -306,6 +400,13 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		return -EIO;
 	}
 
+	rc = init_fat_window(ef, options);
+	if (rc != 0)
+	{
+		exfat_free(ef);
+		return rc;
+	}
+
 	ef->root = malloc(sizeof(struct exfat_node));
 	if (ef->root == NULL)
 	{
@@ -317,7 +418,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 	ef->root->attrib = EXFAT_ATTRIB_DIR;
 	ef->root->start_cluster = le32_to_cpu(ef->sb->rootdir_cluster);
 	ef->root->fptr_cluster = ef->root->start_cluster;
-	ef->root->name[0] = cpu_to_le16('\0');
+	ef->root->name = root_name;
 	ef->root->size = rootdir_size(ef);
 	if (ef->root->size == 0)
 	{
@@ -338,7 +439,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		exfat_error("upcase table is not found");
 		goto error;
 	}
-	if (ef->cmap.chunk == NULL)
+	if (ef->cmap.start_cluster == 0)
 	{
 		exfat_error("clusters bitmap is not found");
 		goto error;
@@ -366,7 +467,7 @@ static void finalize_super_block(struct exfat* ef)
 
 	/* Some implementations set the percentage of allocated space to 0xff
 	   on FS creation and never update it. In this case leave it as is. */
-	if (ef->sb->allocated_percent != 0xff)
+	if (ef->sb->allocated_percent != 0xff && exfat_load_bitmap(ef) == 0)
 	{
 		uint32_t free, total;
 
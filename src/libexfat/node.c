@@ -27,6 +27,248 @@
 
 #define EXFAT_ENTRY_NONE (-1)
 
+/* directory read-ahead size limits, both must be powers of 2 */
+#define DIR_READAHEAD_MIN 4096
+#define DIR_READAHEAD_MAX 65536
+
+/* number of nodes in a chunk, doubles with every new chunk up to the max */
+#define NODE_CHUNK_MIN 32
+#define NODE_CHUNK_MAX 1024
+
+/* size of a names chunk in le16_t, fits any name many times */
+#define NAME_CHUNK_SIZE 16384
+
+/* size of a name slot in le16_t, a free slot links the next free one of the
+   same length in place of the characters so short names get bigger slots */
+#define NAME_SLOT_SIZE(length) \
+		MAX((length) + 2, 1 + sizeof(void*) / sizeof(uint16_t))
+
+/* directory index size limits in buckets, name hashes are 16 bits wide */
+#define DIR_INDEX_MIN 16
+#define DIR_INDEX_MAX 65536
+
+/* directory entries read ahead while scanning a directory */
+struct dir_buffer
+{
+	char* data;
+	off_t offset;			/* directory offset of the buffered part */
+	size_t size;			/* in bytes, 0 if nothing is buffered */
+	size_t capacity;		/* in bytes */
+};
+
+/*
+ * Nodes are carved from per-mount chunks instead of being malloc'ed one by
+ * one. Released nodes go to a free list and are reused, chunks are freed
+ * only by exfat_free_nodes() on unmount.
+ */
+static struct exfat_node* allocate_node(struct exfat* ef)
+{
+	struct exfat_node_chunk* chunk = ef->nodes.chunks;
+	struct exfat_node* node;
+	size_t count;
+
+	if (ef->nodes.free != NULL)
+	{
+		node = ef->nodes.free;
+		ef->nodes.free = node->next;
+	}
+	else
+	{
+		if (chunk == NULL || chunk->used == chunk->count)
+		{
+			count = chunk ? MIN(chunk->count * 2, NODE_CHUNK_MAX)
+					: NODE_CHUNK_MIN;
+			chunk = malloc(sizeof(struct exfat_node_chunk) +
+					count * sizeof(struct exfat_node));
+			if (chunk == NULL)
+			{
+				exfat_error("failed to allocate node");
+				return NULL;
+			}
+			chunk->next = ef->nodes.chunks;
+			chunk->count = count;
+			chunk->used = 0;
+			ef->nodes.chunks = chunk;
+		}
+		node = &chunk->nodes[chunk->used++];
+	}
+	memset(node, 0, sizeof(struct exfat_node));
+	return node;
+}
+
+static void free_index(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_dir_index* index = dir->index;
+
+	if (index == NULL)
+		return;
+	if (index->prev)
+		index->prev->next = index->next;
+	else
+		ef->nodes.indexes = index->next;
+	if (index->next)
+		index->next->prev = index->prev;
+	free(index);
+	dir->index = NULL;
+}
+
+static void index_insert(struct exfat_dir_index* index,
+		struct exfat_node* node)
+{
+	struct exfat_node** bucket =
+			&index->buckets[le16_to_cpu(node->name_hash) & (index->size - 1)];
+
+	node->hash_next = *bucket;
+	*bucket = node;
+	index->count++;
+}
+
+static void index_remove(struct exfat_dir_index* index,
+		struct exfat_node* node)
+{
+	struct exfat_node** p =
+			&index->buckets[le16_to_cpu(node->name_hash) & (index->size - 1)];
+
+	for (; *p != NULL; p = &(*p)->hash_next)
+		if (*p == node)
+		{
+			*p = node->hash_next;
+			node->hash_next = NULL;
+			index->count--;
+			return;
+		}
+}
+
+/*
+ * (Re)build the index of the directory children with about one child per
+ * bucket. On failure the old index, if any, is kept: it is still valid.
+ */
+static void build_index(struct exfat* ef, struct exfat_node* dir,
+		uint32_t count)
+{
+	struct exfat_dir_index* index;
+	struct exfat_node* node;
+	uint32_t size = DIR_INDEX_MIN;
+
+	while (size < count && size < DIR_INDEX_MAX)
+		size *= 2;
+
+	index = calloc(1, sizeof(struct exfat_dir_index) +
+			size * sizeof(struct exfat_node*));
+	if (index == NULL)
+		return;
+	index->size = size;
+	for (node = dir->child; node; node = node->next)
+		index_insert(index, node);
+
+	free_index(ef, dir);
+	index->next = ef->nodes.indexes;
+	if (index->next)
+		index->next->prev = index;
+	ef->nodes.indexes = index;
+	dir->index = index;
+}
+
+static void free_name(struct exfat* ef, const le16_t* name, size_t length)
+{
+	struct exfat_name_chunk* chunk = ef->nodes.names;
+	le16_t* slot = (le16_t*) name;
+
+	if (name == NULL)
+		return;
+
+	/* the last name interned goes back to the chunk, which is the case for
+	   nodes parsed and dropped right away */
+	if (chunk != NULL &&
+			slot - 1 + NAME_SLOT_SIZE(length) == chunk->names + chunk->used)
+	{
+		chunk->used -= NAME_SLOT_SIZE(length);
+		return;
+	}
+
+	/* names are only 2 bytes aligned */
+	memcpy(slot, &ef->nodes.free_names[length], sizeof(le16_t*));
+	ef->nodes.free_names[length] = slot;
+}
+
+static void free_node(struct exfat* ef, struct exfat_node* node)
+{
+	free_index(ef, node);
+	free_name(ef, node->name, node->name_length);
+	node->next = ef->nodes.free;
+	ef->nodes.free = node;
+}
+
+/* copy the name to the names chunk, returns NULL if out of memory */
+static const le16_t* intern_name(struct exfat* ef, const le16_t* name,
+		size_t length)
+{
+	struct exfat_name_chunk* chunk = ef->nodes.names;
+	le16_t* p;
+
+	/* reuse a slot of a freed name of the same length */
+	p = ef->nodes.free_names[length];
+	if (p != NULL)
+	{
+		memcpy(&ef->nodes.free_names[length], p, sizeof(le16_t*));
+		memcpy(p, name, length * sizeof(le16_t));
+		p[length] = cpu_to_le16(0);
+		return p;
+	}
+
+	if (chunk == NULL || chunk->used + NAME_SLOT_SIZE(length) > chunk->size)
+	{
+		chunk = malloc(sizeof(struct exfat_name_chunk) +
+				NAME_CHUNK_SIZE * sizeof(le16_t));
+		if (chunk == NULL)
+		{
+			exfat_error("failed to allocate node name");
+			return NULL;
+		}
+		chunk->next = ef->nodes.names;
+		chunk->size = NAME_CHUNK_SIZE;
+		chunk->used = 0;
+		ef->nodes.names = chunk;
+	}
+
+	p = chunk->names + chunk->used;
+	p[0] = cpu_to_le16(length);
+	memcpy(p + 1, name, length * sizeof(le16_t));
+	p[1 + length] = cpu_to_le16(0);
+	chunk->used += NAME_SLOT_SIZE(length);
+	return p + 1;
+}
+
+void exfat_free_nodes(struct exfat* ef)
+{
+	struct exfat_node_chunk* chunk;
+	struct exfat_name_chunk* names;
+	struct exfat_dir_index* index;
+
+	while (ef->nodes.chunks != NULL)
+	{
+		chunk = ef->nodes.chunks;
+		ef->nodes.chunks = chunk->next;
+		free(chunk);
+	}
+	ef->nodes.free = NULL;
+
+	while (ef->nodes.names != NULL)
+	{
+		names = ef->nodes.names;
+		ef->nodes.names = names->next;
+		free(names);
+	}
+	memset(ef->nodes.free_names, 0, sizeof(ef->nodes.free_names));
+
+	while (ef->nodes.indexes != NULL)
+	{
+		index = ef->nodes.indexes;
+		ef->nodes.indexes = index->next;
+		free(index);
+	}
+}
+
 struct exfat_node* exfat_get_node(struct exfat_node* node)
 {
 	/* if we switch to multi-threaded mode we will need atomic
@@ -72,7 +314,7 @@ int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 		/* free all clusters and node structure itself */
 		rc = exfat_truncate(ef, node, 0, true);
 		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		free_node(ef, node);
 	}
 	return rc;
 }
@@ -98,6 +340,48 @@ static int read_entries(struct exfat* ef, struct exfat_node* dir,
 	return -EIO;
 }
 
+/*
+ * Same as read_entries() but serves entries from the read-ahead buffer,
+ * which is refilled with large aligned reads. An entry set that straddles
+ * the buffer boundary is re-read starting from its first entry.
+ */
+static int read_entries_buffered(struct exfat* ef, struct exfat_node* dir,
+		struct dir_buffer* buf, struct exfat_entry* entries, int n,
+		off_t offset)
+{
+	const size_t length = sizeof(struct exfat_entry[n]);
+	off_t start;
+	ssize_t size;
+
+	if (buf->size == 0 || offset < buf->offset ||
+			offset + length > buf->offset + buf->size)
+	{
+		if (offset >= dir->size)
+			return -ENOENT;
+
+		start = offset / buf->capacity * buf->capacity;
+		if (offset + length > start + buf->capacity)
+			start = offset;
+		size = exfat_generic_pread(ef, dir, buf->data, buf->capacity, start);
+		if (size < 0)
+		{
+			buf->size = 0;
+			return -EIO;
+		}
+		buf->offset = start;
+		buf->size = size;
+		if (offset + length > buf->offset + buf->size)
+		{
+			exfat_error("read %"PRId64" bytes instead of %zu bytes",
+					buf->offset + buf->size - offset, length);
+			return -EIO;
+		}
+	}
+
+	memcpy(entries, buf->data + (offset - buf->offset), length);
+	return 0;
+}
+
 static int write_entries(struct exfat* ef, struct exfat_node* dir,
 		const struct exfat_entry* entries, int n, off_t offset)
 {
@@ -117,18 +401,6 @@ static int write_entries(struct exfat* ef, struct exfat_node* dir,
 	return -EIO;
 }
 
-static struct exfat_node* allocate_node(void)
-{
-	struct exfat_node* node = malloc(sizeof(struct exfat_node));
-	if (node == NULL)
-	{
-		exfat_error("failed to allocate node");
-		return NULL;
-	}
-	memset(node, 0, sizeof(struct exfat_node));
-	return node;
-}
-
 static void init_node_meta1(struct exfat_node* node,
 		const struct exfat_entry_meta1* meta1)
 {
@@ -144,20 +416,26 @@ static void init_node_meta2(struct exfat_node* node,
 		const struct exfat_entry_meta2* meta2)
 {
 	node->size = le64_to_cpu(meta2->size);
+	node->name_hash = meta2->name_hash;
 	node->start_cluster = le32_to_cpu(meta2->start_cluster);
 	node->fptr_cluster = node->start_cluster;
 	node->is_contiguous = ((meta2->flags & EXFAT_FLAG_CONTIGUOUS) != 0);
 }
 
-static void init_node_name(struct exfat_node* node,
+static int init_node_name(struct exfat* ef, struct exfat_node* node,
 		const struct exfat_entry* entries, int n)
 {
+	le16_t name[EXFAT_NAME_MAX + 1];
 	int i;
 
+	memset(name, 0, sizeof(name));
 	for (i = 0; i < n; i++)
-		memcpy(node->name + i * EXFAT_ENAME_MAX,
+		memcpy(name + i * EXFAT_ENAME_MAX,
 				((const struct exfat_entry_name*) &entries[i])->name,
 				EXFAT_ENAME_MAX * sizeof(le16_t));
+	node->name_length = utf16_length(name);
+	node->name = intern_name(ef, name, node->name_length);
+	return node->name != NULL ? 0 : -ENOMEM;
 }
 
 static bool check_entries(const struct exfat_entry* entry, int n)
@@ -299,6 +577,7 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 	const struct exfat_entry_meta1* meta1;
 	const struct exfat_entry_meta2* meta2;
 	int mandatory_entries;
+	int rc;
 
 	if (!check_entries(entries, n))
 		return -EIO;
@@ -325,7 +604,9 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 
 	init_node_meta1(node, meta1);
 	init_node_meta2(node, meta2);
-	init_node_name(node, entries + 2, mandatory_entries - 2);
+	rc = init_node_name(ef, node, entries + 2, mandatory_entries - 2);
+	if (rc != 0)
+		return rc;
 
 	if (!check_node(ef, node, exfat_calc_checksum(entries, n), meta1, meta2))
 		return -EIO;
@@ -334,17 +615,18 @@ static int parse_file_entries(struct exfat* ef, struct exfat_node* node,
 }
 
 static int parse_file_entry(struct exfat* ef, struct exfat_node* parent,
-		struct exfat_node** node, off_t* offset, int n)
+		struct dir_buffer* buf, struct exfat_node** node, off_t* offset,
+		int n)
 {
 	struct exfat_entry entries[n];
 	int rc;
 
-	rc = read_entries(ef, parent, entries, n, *offset);
+	rc = read_entries_buffered(ef, parent, buf, entries, n, *offset);
 	if (rc != 0)
 		return rc;
 
 	/* a new node has zero references */
-	*node = allocate_node();
+	*node = allocate_node(ef);
 	if (*node == NULL)
 		return -ENOMEM;
 	(*node)->entry_offset = *offset;
@@ -352,7 +634,7 @@ static int parse_file_entry(struct exfat* ef, struct exfat_node* parent,
 	rc = parse_file_entries(ef, *node, entries, n);
 	if (rc != 0)
 	{
-		free(*node);
+		free_node(ef, *node);
 		return rc;
 	}
 
@@ -385,7 +667,7 @@ static void decompress_upcase(uint16_t* output, const le16_t* source,
  * structure.
  */
 static int readdir(struct exfat* ef, struct exfat_node* parent,
-		struct exfat_node** node, off_t* offset)
+		struct dir_buffer* buf, struct exfat_node** node, off_t* offset)
 {
 	int rc;
 	struct exfat_entry entry;
@@ -398,7 +680,7 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 
 	for (;;)
 	{
-		rc = read_entries(ef, parent, &entry, 1, *offset);
+		rc = read_entries_buffered(ef, parent, buf, &entry, 1, *offset);
 		if (rc != 0)
 			return rc;
 
@@ -406,7 +688,7 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 		{
 		case EXFAT_ENTRY_FILE:
 			meta1 = (const struct exfat_entry_meta1*) &entry;
-			return parse_file_entry(ef, parent, node, offset,
+			return parse_file_entry(ef, parent, buf, node, offset,
 					1 + meta1->continuations);
 
 		case EXFAT_ENTRY_UPCASE:
@@ -479,25 +761,13 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 						DIV_ROUND_UP(ef->cmap.size, 8));
 				return -EIO;
 			}
-			/* FIXME bitmap can be rather big, up to 512 MB */
-			ef->cmap.chunk_size = ef->cmap.size;
-			ef->cmap.chunk = malloc(BMAP_SIZE(ef->cmap.chunk_size));
-			if (ef->cmap.chunk == NULL)
-			{
-				exfat_error("failed to allocate clusters bitmap chunk "
-						"(%"PRIu64" bytes)", le64_to_cpu(bitmap->size));
-				return -ENOMEM;
-			}
-
-			if (exfat_pread(ef->dev, ef->cmap.chunk,
-					BMAP_SIZE(ef->cmap.chunk_size),
-					exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
-			{
-				exfat_error("failed to read clusters bitmap "
-						"(%"PRIu64" bytes starting at cluster %#x)",
-						le64_to_cpu(bitmap->size), ef->cmap.start_cluster);
-				return -EIO;
-			}
+			/* bitmap can be rather big, up to 512 MB, lookup-only mounts
+			   read it when it is really needed */
+			if (ef->lookup)
+				break;
+			rc = exfat_load_bitmap(ef);
+			if (rc != 0)
+				return rc;
 			break;
 
 		case EXFAT_ENTRY_LABEL:
@@ -525,18 +795,58 @@ static int readdir(struct exfat* ef, struct exfat_node* parent,
 	/* we never reach here */
 }
 
+static int init_dir_buffer(const struct exfat* ef, struct dir_buffer* buf)
+{
+	buf->offset = 0;
+	buf->size = 0;
+	buf->capacity = MAX(MIN(CLUSTER_SIZE(*ef->sb), DIR_READAHEAD_MAX),
+			DIR_READAHEAD_MIN);
+	buf->data = malloc(buf->capacity);
+	if (buf->data == NULL)
+	{
+		exfat_error("failed to allocate directory buffer (%zu bytes)",
+				buf->capacity);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static struct exfat_node* find_child_at(const struct exfat_node* dir,
+		off_t entry_offset)
+{
+	struct exfat_node* p;
+
+	for (p = dir->child; p != NULL; p = p->next)
+		if (p->entry_offset == entry_offset)
+			return p;
+	return NULL;
+}
+
 int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 {
 	off_t offset = 0;
 	int rc;
 	struct exfat_node* node;
+	struct exfat_node* first = NULL;
 	struct exfat_node* current = NULL;
+	struct dir_buffer buf;
 
 	if (dir->is_cached)
 		return 0; /* already cached */
 
-	while ((rc = readdir(ef, dir, &node, &offset)) == 0)
+	rc = init_dir_buffer(ef, &buf);
+	if (rc != 0)
+		return rc;
+
+	while ((rc = readdir(ef, dir, &buf, &node, &offset)) == 0)
 	{
+		/* the node can be already attached by exfat_find_node() */
+		if (find_child_at(dir, node->entry_offset) != NULL)
+		{
+			free_node(ef, node);
+			continue;
+		}
+
 		node->parent = dir;
 		if (current != NULL)
 		{
@@ -544,28 +854,40 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 			node->prev = current;
 		}
 		else
-			dir->child = node;
+			first = node;
 
 		current = node;
 	}
+	free(buf.data);
 
 	if (rc != -ENOENT)
 	{
 		/* rollback */
-		for (current = dir->child; current; current = node)
+		for (current = first; current; current = node)
 		{
 			node = current->next;
-			free(current);
+			free_node(ef, current);
 		}
-		dir->child = NULL;
 		return rc;
 	}
 
+	if (first != NULL)
+	{
+		if (dir->child != NULL)
+		{
+			for (node = dir->child; node->next; node = node->next);
+			node->next = first;
+			first->prev = node;
+		}
+		else
+			dir->child = first;
+	}
 	dir->is_cached = true;
 	return 0;
 }
 
-static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
+static void tree_attach(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node)
 {
 	node->parent = dir;
 	if (dir->child)
@@ -574,10 +896,21 @@ static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
 		node->next = dir->child;
 	}
 	dir->child = node;
+
+	if (dir->index)
+	{
+		index_insert(dir->index, node);
+		/* keep chains short when many children are created */
+		if (dir->index->count > 2 * dir->index->size &&
+				dir->index->size < DIR_INDEX_MAX)
+			build_index(ef, dir, dir->index->count);
+	}
 }
 
 static void tree_detach(struct exfat_node* node)
 {
+	if (node->parent->index)
+		index_remove(node->parent->index, node);
 	if (node->prev)
 		node->prev->next = node->next;
 	else /* this is the first node in the list */
@@ -589,18 +922,132 @@ static void tree_detach(struct exfat_node* node)
 	node->next = NULL;
 }
 
-static void reset_cache(struct exfat* ef, struct exfat_node* node)
+/*
+ * Find an attached child by name. The first search in a directory scans the
+ * children list, the second one in a cached directory builds a hash index
+ * over them that tree_attach() and tree_detach() keep up to date.
+ */
+static struct exfat_node* find_child(struct exfat* ef, struct exfat_node* dir,
+		const le16_t* name, size_t length, le16_t hash)
 {
-	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+	struct exfat_node* node;
+	uint32_t count = 0;
 
-	while (node->child)
+	if (dir->index == NULL)
 	{
-		struct exfat_node* p = node->child;
-		reset_cache(ef, p);
-		tree_detach(p);
-		free(p);
+		if (dir->is_cached && dir->is_searched)
+		{
+			for (node = dir->child; node; node = node->next)
+				count++;
+			build_index(ef, dir, count);
+		}
+		dir->is_searched = true;
+	}
+
+	if (dir->index)
+		node = dir->index->buckets[le16_to_cpu(hash) & (dir->index->size - 1)];
+	else
+		node = dir->child;
+
+	for (; node; node = dir->index ? node->hash_next : node->next)
+		if (node->name_length == length &&
+				le16_to_cpu(node->name_hash) == le16_to_cpu(hash) &&
+				exfat_compare_name(ef, name, node->name) == 0)
+			return node;
+	return NULL;
+}
+
+/*
+ * Find a node by name. In a directory that is not cached only entry sets
+ * whose name hash and length match the name are parsed into nodes. The found
+ * node is attached to the directory and returned with a reference. A
+ * directory searched again is cached so that the search uses the index.
+ */
+int exfat_find_node(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node** node, const le16_t* name)
+{
+	const size_t length = utf16_length(name);
+	const le16_t hash = exfat_calc_name_hash(ef, name, length);
+	struct exfat_entry entries[2];
+	const struct exfat_entry_meta1* meta1 =
+			(const struct exfat_entry_meta1*) &entries[0];
+	const struct exfat_entry_meta2* meta2 =
+			(const struct exfat_entry_meta2*) &entries[1];
+	struct dir_buffer buf;
+	off_t offset = 0;
+	int rc;
+
+	*node = NULL;
+
+	/* lookup-only mounts cache a directory once it is searched twice */
+	if (!dir->is_cached && dir->is_searched)
+	{
+		rc = exfat_cache_directory(ef, dir);
+		if (rc != 0)
+			return rc;
+	}
+
+	/* nodes found before are already attached to the directory */
+	*node = find_child(ef, dir, name, length, hash);
+	if (*node != NULL)
+	{
+		exfat_get_node(*node);
+		return 0;
+	}
+	if (dir->is_cached)
+		return -ENOENT;
+
+	rc = init_dir_buffer(ef, &buf);
+	if (rc != 0)
+		return rc;
+
+	for (;;)
+	{
+		rc = read_entries_buffered(ef, dir, &buf, entries, 1, offset);
+		if (rc != 0)
+			break;
+		if (entries[0].type != EXFAT_ENTRY_FILE || meta1->continuations < 2)
+		{
+			offset += sizeof(struct exfat_entry);
+			continue;
+		}
+
+		rc = read_entries_buffered(ef, dir, &buf, entries, 2, offset);
+		if (rc != 0)
+			break;
+		if (entries[1].type != EXFAT_ENTRY_FILE_INFO ||
+				meta2->name_length != length ||
+				le16_to_cpu(meta2->name_hash) != le16_to_cpu(hash) ||
+				find_child_at(dir, offset) != NULL)
+		{
+			offset += sizeof(struct exfat_entry[1 + meta1->continuations]);
+			continue;
+		}
+
+		rc = parse_file_entry(ef, dir, &buf, node, &offset,
+				1 + meta1->continuations);
+		if (rc != 0)
+			break;
+		if (exfat_compare_name(ef, name, (*node)->name) == 0)
+		{
+			tree_attach(ef, dir, *node);
+			exfat_get_node(*node);
+			break;
+		}
+		free_node(ef, *node);
+		*node = NULL;
 	}
+	free(buf.data);
+	return rc;
+}
+
+static void reset_node(struct exfat* ef, struct exfat_node* node)
+{
+	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+
 	node->is_cached = false;
+	node->is_searched = false;
+	free_index(ef, node);
 	if (node->references != 0)
 	{
 		exfat_get_name(node, buffer);
@@ -616,8 +1063,47 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 		exfat_put_node(ef, node);
 }
 
+static void reset_cache(struct exfat* ef, struct exfat_node* node)
+{
+	while (node->child)
+	{
+		struct exfat_node* p = node->child;
+		reset_cache(ef, p);
+		tree_detach(p);
+		free_node(ef, p);
+	}
+	reset_node(ef, node);
+}
+
+/* warn about referenced nodes with one pass over the node chunks */
+static void check_references(struct exfat* ef)
+{
+	char buffer[EXFAT_UTF8_NAME_BUFFER_MAX];
+	struct exfat_node_chunk* chunk;
+	size_t i;
+
+	for (chunk = ef->nodes.chunks; chunk != NULL; chunk = chunk->next)
+		for (i = 0; i < chunk->used; i++)
+			if (chunk->nodes[i].references != 0)
+			{
+				exfat_get_name(&chunk->nodes[i], buffer);
+				exfat_warn("non-zero reference counter (%d) for '%s'",
+						chunk->nodes[i].references, buffer);
+			}
+}
+
 void exfat_reset_cache(struct exfat* ef)
 {
+	if (ef->ro)
+	{
+		/* nodes of a read-only mount are never dirty, so only references
+		   are checked before the whole tree and its chunks are dropped */
+		check_references(ef);
+		ef->root->child = NULL;
+		reset_node(ef, ef->root);
+		exfat_free_nodes(ef);
+		return;
+	}
 	reset_cache(ef, ef->root);
 }
 
@@ -705,11 +1191,14 @@ static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
 	const struct exfat_node* last_node;
 	uint64_t entries = 0;
 	uint64_t new_size;
+	int rc;
 
 	if (!(dir->attrib & EXFAT_ATTRIB_DIR))
 		exfat_bug("attempted to shrink a file");
-	if (!dir->is_cached)
-		exfat_bug("attempted to shrink uncached directory");
+	/* directory can be partially loaded by exfat_find_node() */
+	rc = exfat_cache_directory(ef, dir);
+	if (rc != 0)
+		return rc;
 
 	for (last_node = node = dir->child; node; node = node->next)
 	{
@@ -730,8 +1219,7 @@ static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
 		/* two subentries with meta info */
 		entries += 2;
 		/* subentries with file name */
-		entries += DIV_ROUND_UP(utf16_length(last_node->name),
-				EXFAT_ENAME_MAX);
+		entries += DIV_ROUND_UP(last_node->name_length, EXFAT_ENAME_MAX);
 	}
 
 	new_size = DIV_ROUND_UP(entries * sizeof(struct exfat_entry),
@@ -822,9 +1310,12 @@ static int find_slot(struct exfat* ef, struct exfat_node* dir,
 	struct exfat_node* p;
 	size_t i;
 	int contiguous = 0;
+	int rc;
 
-	if (!dir->is_cached)
-		exfat_bug("directory is not cached");
+	/* directory can be partially loaded by exfat_find_node() */
+	rc = exfat_cache_directory(ef, dir);
+	if (rc != 0)
+		return rc;
 
 	/* build a bitmap of valid entries in the directory */
 	dmap = calloc(BMAP_SIZE(dir->size / sizeof(struct exfat_entry)),
@@ -922,15 +1413,21 @@ static int commit_entry(struct exfat* ef, struct exfat_node* dir,
 	if (rc != 0)
 		return rc;
 
-	node = allocate_node();
+	node = allocate_node(ef);
 	if (node == NULL)
 		return -ENOMEM;
 	node->entry_offset = offset;
-	memcpy(node->name, name, name_length * sizeof(le16_t));
+	node->name = intern_name(ef, name, name_length);
+	if (node->name == NULL)
+	{
+		free_node(ef, node);
+		return -ENOMEM;
+	}
+	node->name_length = name_length;
 	init_node_meta1(node, meta1);
 	init_node_meta2(node, meta2);
 
-	tree_attach(dir, node);
+	tree_attach(ef, dir, node);
 	return 0;
 }
 
@@ -1014,6 +1511,7 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	struct exfat_entry entries[2 + name_entries];
 	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) &entries[0];
 	struct exfat_entry_meta2* meta2 = (struct exfat_entry_meta2*) &entries[1];
+	const le16_t* new_name;
 	int rc;
 	int i;
 
@@ -1021,13 +1519,21 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	if (rc != 0)
 		return rc;
 
+	/* intern the new name before anything is changed on disk */
+	new_name = intern_name(ef, name, name_length);
+	if (new_name == NULL)
+		return -ENOMEM;
+
 	meta1->continuations = 1 + name_entries;
 	meta2->name_length = name_length;
 	meta2->name_hash = exfat_calc_name_hash(ef, name, name_length);
 
 	rc = erase_node(ef, node);
 	if (rc != 0)
+	{
+		free_name(ef, new_name, name_length);
 		return rc;
+	}
 
 	node->entry_offset = new_offset;
 	node->continuations = 1 + name_entries;
@@ -1046,11 +1552,18 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 	meta1->checksum = exfat_calc_checksum(entries, 2 + name_entries);
 	rc = write_entries(ef, dir, entries, 2 + name_entries, new_offset);
 	if (rc != 0)
+	{
+		free_name(ef, new_name, name_length);
 		return rc;
+	}
 
-	memcpy(node->name, name, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
+	/* the index of the old parent finds the node by its old name hash */
 	tree_detach(node);
-	tree_attach(dir, node);
+	free_name(ef, node->name, node->name_length);
+	node->name = new_name;
+	node->name_length = name_length;
+	node->name_hash = meta2->name_hash;
+	tree_attach(ef, dir, node);
 	return 0;
 }
 
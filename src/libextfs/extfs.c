@@ -0,0 +1,483 @@
+/******************************************************************************
+ * extfs.c  ---- read only ext2/3/4 parser used to get the file blocklist
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <extfs.h>
+
+#define EXTFS_MIN(a, b)         ((a) < (b) ? (a) : (b))
+#define EXTFS_SUPER_OFFSET      1024
+#define EXTFS_SUPER_MAGIC       0xEF53
+#define EXTFS_EXTENT_MAGIC      0xF30A
+#define EXTFS_EXTENT_MAX_DEPTH  5
+#define EXTFS_INIT_MAX_LEN      32768
+#define EXTFS_NAME_MAX          255
+#define EXTFS_INODE_READ        160
+
+/* adjacent tree nodes and directory blocks are read together, at most this many blocks */
+#define EXTFS_BATCH_BLOCKS      64
+
+static int extfs_group_has_super(extfs_vol *vol, uint64_t group)
+{
+    uint64_t n;
+    uint64_t base;
+
+    if (group <= 1 || (vol->ro_compat & EXTFS_RO_COMPAT_SPARSE_SUPER) == 0)
+    {
+        return 1;
+    }
+
+    for (base = 3; base <= 7; base += 2)
+    {
+        for (n = base; n < group; n *= base)
+        {
+            ;
+        }
+        if (n == group)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* block that holds the descriptor of the group */
+static uint64_t extfs_desc_block(extfs_vol *vol, uint64_t group)
+{
+    uint64_t metagroup;
+    uint64_t first;
+    uint32_t perblock = vol->block_size / vol->desc_size;
+
+    metagroup = group / perblock;
+    if ((vol->incompat & EXTFS_INCOMPAT_META_BG) == 0 || metagroup < vol->first_meta_bg)
+    {
+        return vol->first_data_block + 1 + metagroup;
+    }
+
+    /* with meta_bg the descriptors live in the first group of every meta group */
+    first = metagroup * perblock;
+    return vol->first_data_block + first * vol->blocks_per_group + extfs_group_has_super(vol, first);
+}
+
+static int extfs_read_inode(extfs_vol *vol, uint32_t ino, uint8_t *inode)
+{
+    int rc;
+    uint64_t group;
+    uint64_t table;
+    uint32_t perblock;
+    uint8_t desc[64];
+
+    if (ino == 0 || (uint64_t)(ino - 1) / vol->inodes_per_group >= vol->group_count)
+    {
+        return -EINVAL;
+    }
+
+    group = (ino - 1) / vol->inodes_per_group;
+    perblock = vol->block_size / vol->desc_size;
+
+    rc = vtoy_pread(vol->fd, desc, vol->desc_size, extfs_desc_block(vol, group) * vol->block_size +
+                    (group % perblock) * vol->desc_size, &vol->reads);
+    if (rc)
+    {
+        return rc;
+    }
+
+    table = extfs_le32(desc + 8);
+    if (vol->desc_size >= 64)
+    {
+        table |= (uint64_t)extfs_le32(desc + 40) << 32;
+    }
+
+    return vtoy_pread(vol->fd, inode, EXTFS_INODE_READ,
+                      table * vol->block_size + (uint64_t)((ino - 1) % vol->inodes_per_group) * vol->inode_size,
+                      &vol->reads);
+}
+
+/* walk one extent tree node, children of an index node are read in batches of adjacent blocks */
+static int extfs_walk_node(extfs_vol *vol, const uint8_t *node, uint32_t len, int depth, vtoy_runlist *list)
+{
+    int rc = 0;
+    uint32_t i;
+    uint32_t k;
+    uint32_t run;
+    uint32_t len16;
+    uint16_t entries;
+    uint64_t child;
+    uint8_t *buf = NULL;
+    const uint8_t *ent = NULL;
+
+    entries = extfs_le16(node + 2);
+    if (extfs_le16(node) != EXTFS_EXTENT_MAGIC || extfs_le16(node + 6) != depth ||
+        entries > extfs_le16(node + 4) || 12 + entries * 12 > len)
+    {
+        debug("bad extent node depth %d\n", depth);
+        return -EIO;
+    }
+
+    if (depth == 0)
+    {
+        for (i = 0; i < entries && rc == 0; i++)
+        {
+            ent = node + 12 + i * 12;
+            len16 = extfs_le16(ent + 4);
+            child = ((uint64_t)extfs_le16(ent + 6) << 32) | extfs_le32(ent + 8);
+            if (len16 > EXTFS_INIT_MAX_LEN)
+            {
+                rc = vtoy_runlist_add(list, extfs_le32(ent), VTOY_RUN_HOLE, len16 - EXTFS_INIT_MAX_LEN);
+            }
+            else
+            {
+                rc = vtoy_runlist_add(list, extfs_le32(ent), child, len16);
+            }
+        }
+        return rc;
+    }
+
+    buf = (uint8_t *)malloc((size_t)vol->block_size * EXTFS_BATCH_BLOCKS);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < entries && rc == 0; i += run)
+    {
+        ent = node + 12 + i * 12;
+        child = ((uint64_t)extfs_le16(ent + 8) << 32) | extfs_le32(ent + 4);
+
+        /* count the following children that are right after this one on disk */
+        for (run = 1; i + run < entries && run < EXTFS_BATCH_BLOCKS; run++)
+        {
+            ent = node + 12 + (i + run) * 12;
+            if ((((uint64_t)extfs_le16(ent + 8) << 32) | extfs_le32(ent + 4)) != child + run)
+            {
+                break;
+            }
+        }
+
+        rc = vtoy_pread(vol->fd, buf, (size_t)run * vol->block_size, child * vol->block_size, &vol->reads);
+        for (k = 0; k < run && rc == 0; k++)
+        {
+            rc = extfs_walk_node(vol, buf + (size_t)k * vol->block_size, vol->block_size, depth - 1, list);
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+/* legacy block map, level 0 is a data block, 1..3 are indirect blocks */
+static int extfs_walk_indirect(extfs_vol *vol, uint32_t blk, int level, uint64_t *lblk, uint64_t maxblk, vtoy_runlist *list)
+{
+    int rc = 0;
+    uint32_t i;
+    uint32_t perblock = vol->block_size / 4;
+    uint64_t span = 1;
+    uint8_t *buf = NULL;
+
+    for (i = 0; i < (uint32_t)level; i++)
+    {
+        span *= perblock;
+    }
+
+    if (blk == 0)
+    {
+        /* hole */
+        *lblk += span;
+        return 0;
+    }
+
+    if (level == 0)
+    {
+        return vtoy_runlist_add(list, (*lblk)++, blk, 1);
+    }
+
+    buf = (uint8_t *)malloc(vol->block_size);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+
+    rc = vtoy_pread(vol->fd, buf, vol->block_size, (uint64_t)blk * vol->block_size, &vol->reads);
+    for (i = 0; i < perblock && *lblk < maxblk && rc == 0; i++)
+    {
+        rc = extfs_walk_indirect(vol, extfs_le32(buf + i * 4), level - 1, lblk, maxblk, list);
+    }
+
+    free(buf);
+    return rc;
+}
+
+int extfs_get_extents(extfs_vol *vol, uint32_t ino, vtoy_runlist *list)
+{
+    int i;
+    int rc;
+    uint64_t lblk = 0;
+    uint64_t maxblk;
+    uint8_t inode[EXTFS_INODE_READ];
+    const uint8_t *iblock = NULL;
+
+    memset(list, 0, sizeof(vtoy_runlist));
+
+    rc = extfs_read_inode(vol, ino, inode);
+    if (rc)
+    {
+        return rc;
+    }
+
+    list->mode = extfs_le16(inode);
+    list->size = extfs_le32(inode + 4) | ((uint64_t)extfs_le32(inode + 108) << 32);
+    list->flags = extfs_le32(inode + 32);
+    iblock = inode + 40;
+
+    if (list->flags & EXTFS_INLINE_DATA_FL)
+    {
+        debug("inode %u has inline data\n", ino);
+        return -ENOTSUP;
+    }
+
+    if (list->flags & EXTFS_EXTENTS_FL)
+    {
+        if (extfs_le16(iblock + 6) > EXTFS_EXTENT_MAX_DEPTH)
+        {
+            return -EIO;
+        }
+        rc = extfs_walk_node(vol, iblock, 60, extfs_le16(iblock + 6), list);
+    }
+    else
+    {
+        maxblk = (list->size + vol->block_size - 1) / vol->block_size;
+        for (i = 0; i < 15 && lblk < maxblk && rc == 0; i++)
+        {
+            rc = extfs_walk_indirect(vol, extfs_le32(iblock + i * 4), (i < 12) ? 0 : i - 11, &lblk, maxblk, list);
+        }
+    }
+
+    if (rc)
+    {
+        vtoy_runlist_free(list);
+    }
+    return rc;
+}
+
+/* search the entries of directory blocks, htree directories keep plain entries in their leaf blocks */
+static int extfs_search_block(extfs_vol *vol, const uint8_t *block, const char *name, int namelen, uint32_t *child)
+{
+    uint32_t pos = 0;
+    uint32_t reclen;
+    uint32_t entlen;
+
+    while (pos + 8 <= vol->block_size)
+    {
+        reclen = extfs_le16(block + pos + 4);
+        if (reclen == 0 || (reclen == 65535 && vol->block_size >= 65536))
+        {
+            reclen = vol->block_size;
+        }
+
+        entlen = (vol->incompat & EXTFS_INCOMPAT_FILETYPE) ? block[pos + 6] : extfs_le16(block + pos + 6);
+        if (reclen < 8 || pos + reclen > vol->block_size || 8 + entlen > reclen)
+        {
+            debug("bad directory entry at %u\n", pos);
+            return -EIO;
+        }
+
+        if (extfs_le32(block + pos) && entlen == (uint32_t)namelen && memcmp(block + pos + 8, name, namelen) == 0)
+        {
+            *child = extfs_le32(block + pos);
+            return 0;
+        }
+        pos += reclen;
+    }
+
+    return -ENOENT;
+}
+
+/* vtoy_find_child of the ext volume */
+static int extfs_find_in_dir(void *arg, uint64_t dirino, const char *name, int namelen, uint64_t *child)
+{
+    int rc;
+    uint32_t i;
+    uint32_t k;
+    uint32_t ino = 0;
+    uint64_t done;
+    uint64_t count;
+    uint64_t blocks;
+    uint8_t *buf = NULL;
+    extfs_vol *vol = (extfs_vol *)arg;
+    vtoy_runlist list;
+
+    if (namelen > EXTFS_NAME_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    rc = extfs_get_extents(vol, (uint32_t)dirino, &list);
+    if (rc)
+    {
+        return rc;
+    }
+
+    if ((list.mode & 0xF000) != 0x4000)
+    {
+        vtoy_runlist_free(&list);
+        return -ENOTDIR;
+    }
+
+    buf = (uint8_t *)malloc((size_t)vol->block_size * EXTFS_BATCH_BLOCKS);
+    if (!buf)
+    {
+        vtoy_runlist_free(&list);
+        return -ENOMEM;
+    }
+
+    rc = -ENOENT;
+    blocks = (list.size + vol->block_size - 1) / vol->block_size;
+    for (i = 0; i < list.count && rc == -ENOENT; i++)
+    {
+        if (list.runs[i].physical == VTOY_RUN_HOLE)
+        {
+            continue;
+        }
+
+        for (done = 0; done < list.runs[i].count && list.runs[i].logical + done < blocks && rc == -ENOENT; done += count)
+        {
+            count = EXTFS_MIN(list.runs[i].count - done, EXTFS_BATCH_BLOCKS);
+            rc = vtoy_pread(vol->fd, buf, (size_t)count * vol->block_size,
+                            (list.runs[i].physical + done) * vol->block_size, &vol->reads);
+            if (rc)
+            {
+                break;
+            }
+
+            rc = -ENOENT;
+            for (k = 0; k < count && rc == -ENOENT; k++)
+            {
+                rc = extfs_search_block(vol, buf + (size_t)k * vol->block_size, name, namelen, &ino);
+            }
+        }
+    }
+
+    free(buf);
+    vtoy_runlist_free(&list);
+    *child = ino;
+    return rc;
+}
+
+int extfs_lookup(extfs_vol *vol, const char *path, uint32_t *ino)
+{
+    int rc;
+    uint64_t cur = 0;
+
+    rc = vtoy_walk_path(vol, EXTFS_ROOT_INO, path, extfs_find_in_dir, &cur);
+    *ino = (uint32_t)cur;
+    return rc;
+}
+
+int extfs_mount(extfs_vol *vol, const char *devpath)
+{
+    int rc;
+    uint32_t log;
+    uint64_t blocks;
+    uint8_t sb[1024];
+
+    memset(vol, 0, sizeof(extfs_vol));
+
+    vol->fd = open(devpath, O_RDONLY);
+    if (vol->fd < 0)
+    {
+        debug("failed to open %s %d\n", devpath, errno);
+        return -errno;
+    }
+
+    rc = vtoy_pread(vol->fd, sb, sizeof(sb), EXTFS_SUPER_OFFSET, &vol->reads);
+    if (rc)
+    {
+        goto fail;
+    }
+
+    if (extfs_le16(sb + 56) != EXTFS_SUPER_MAGIC)
+    {
+        debug("%s is not ext2/3/4\n", devpath);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    log = extfs_le32(sb + 24);
+    vol->incompat = extfs_le32(sb + 96);
+    vol->ro_compat = extfs_le32(sb + 100);
+    vol->first_data_block = extfs_le32(sb + 20);
+    vol->blocks_per_group = extfs_le32(sb + 32);
+    vol->inodes_per_group = extfs_le32(sb + 40);
+    vol->inode_size = extfs_le32(sb + 76) ? extfs_le16(sb + 88) : 128;
+    vol->desc_size = (vol->incompat & EXTFS_INCOMPAT_64BIT) ? extfs_le16(sb + 254) : 32;
+    vol->first_meta_bg = extfs_le32(sb + 260);
+
+    if (log > 6 || vol->blocks_per_group == 0 || vol->inodes_per_group == 0 ||
+        vol->inode_size < 128 || (vol->inode_size & (vol->inode_size - 1)) ||
+        vol->desc_size < 32 || vol->desc_size > 64 || (vol->desc_size & (vol->desc_size - 1)))
+    {
+        debug("bad ext geometry %u %u %u %u\n", log, vol->blocks_per_group, vol->inode_size, vol->desc_size);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    vol->block_size = 1024U << log;
+    if (vol->inode_size > vol->block_size)
+    {
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    blocks = extfs_le32(sb + 4);
+    if (vol->incompat & EXTFS_INCOMPAT_64BIT)
+    {
+        blocks |= (uint64_t)extfs_le32(sb + 336) << 32;
+    }
+    vol->group_count = (blocks - vol->first_data_block + vol->blocks_per_group - 1) / vol->blocks_per_group;
+
+    if (vol->incompat & EXTFS_INCOMPAT_RECOVER)
+    {
+        debug("ext journal needs recovery, metadata may be stale\n");
+    }
+
+    debug("extfs block %u inode %u groups %llu incompat 0x%x\n", vol->block_size, vol->inode_size,
+          (unsigned long long)vol->group_count, vol->incompat);
+    return 0;
+
+fail:
+    extfs_unmount(vol);
+    return rc;
+}
+
+void extfs_unmount(extfs_vol *vol)
+{
+    if (vol->fd >= 0)
+    {
+        close(vol->fd);
+    }
+
+    memset(vol, 0, sizeof(extfs_vol));
+    vol->fd = -1;
+}
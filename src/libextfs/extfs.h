@@ -0,0 +1,72 @@
+/******************************************************************************
+ * extfs.h  ---- read only ext2/3/4 parser used to get the file blocklist
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __EXTFS_H__
+#define __EXTFS_H__
+
+#include <stdint.h>
+#include <vtoyloc.h>
+
+#define EXTFS_ROOT_INO          2
+
+#define EXTFS_INCOMPAT_FILETYPE     0x0002
+#define EXTFS_INCOMPAT_RECOVER      0x0004
+#define EXTFS_INCOMPAT_META_BG      0x0010
+#define EXTFS_INCOMPAT_EXTENTS      0x0040
+#define EXTFS_INCOMPAT_64BIT        0x0080
+#define EXTFS_RO_COMPAT_SPARSE_SUPER 0x0001
+
+#define EXTFS_EXTENTS_FL        0x00080000
+#define EXTFS_INLINE_DATA_FL    0x10000000
+#define EXTFS_ENCRYPT_FL        0x00000800
+
+typedef struct extfs_vol
+{
+    int fd;
+    uint32_t block_size;
+    uint32_t inode_size;
+    uint32_t inodes_per_group;
+    uint32_t blocks_per_group;
+    uint32_t desc_size;
+    uint32_t first_meta_bg;
+    uint32_t incompat;
+    uint32_t ro_compat;
+    uint64_t first_data_block;
+    uint64_t group_count;
+    uint32_t reads;         // count of disk reads, for debug
+}extfs_vol;
+
+static inline uint16_t extfs_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t extfs_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int extfs_mount(extfs_vol *vol, const char *devpath);
+void extfs_unmount(extfs_vol *vol);
+int extfs_lookup(extfs_vol *vol, const char *path, uint32_t *ino);
+/* unwritten extents are returned as holes, free the list with vtoy_runlist_free() */
+int extfs_get_extents(extfs_vol *vol, uint32_t ino, vtoy_runlist *list);
+
+#endif
@@ -0,0 +1,929 @@
+/******************************************************************************
+ * ntfs.c  ---- read only NTFS parser used to get the file blocklist
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ntfs.h>
+
+#define NTFS_MIN(a, b)      ((a) < (b) ? (a) : (b))
+#define NTFS_MFT_REF_MASK   0x0000FFFFFFFFFFFFULL
+#define NTFS_NAME_MAX       255
+#define NTFS_MAX_DEPTH      32
+#define NTFS_MAX_LIST_SIZE  (16 * 1024 * 1024)
+
+#define NTFS_INDEX_ENTRY_NODE   0x01
+#define NTFS_INDEX_ENTRY_END    0x02
+
+typedef struct ntfs_value
+{
+    uint8_t *buf;
+    uint32_t len;
+}ntfs_value;
+
+typedef int (*ntfs_attr_cb)(ntfs_vol *vol, const uint8_t *attr, void *data);
+
+static const uint16_t ntfs_i30[4] = { '$', 'I', '3', '0' };
+
+/* apply the update sequence array of a FILE or INDX block */
+static int ntfs_fixup(uint8_t *buf, uint32_t size, const char *magic)
+{
+    uint32_t i;
+    uint32_t pos;
+    uint16_t usaofs;
+    uint16_t usacount;
+
+    if (memcmp(buf, magic, 4))
+    {
+        debug("bad %s magic\n", magic);
+        return -EIO;
+    }
+
+    usaofs = ntfs_le16(buf + 4);
+    usacount = ntfs_le16(buf + 6);
+    if (usacount == 0 || (uint32_t)(usacount - 1) * 512 != size || usaofs + usacount * 2 > size)
+    {
+        debug("bad update sequence %u %u\n", usaofs, usacount);
+        return -EIO;
+    }
+
+    for (i = 1; i < usacount; i++)
+    {
+        pos = i * 512 - 2;
+        if (buf[pos] != buf[usaofs] || buf[pos + 1] != buf[usaofs + 1])
+        {
+            debug("torn %s block at %u\n", magic, pos);
+            return -EIO;
+        }
+        buf[pos] = buf[usaofs + i * 2];
+        buf[pos + 1] = buf[usaofs + i * 2 + 1];
+    }
+
+    return 0;
+}
+
+/* decode the mapping pairs of a non resident attribute and append them to rl */
+static int ntfs_decode_runs(const uint8_t *attr, vtoy_runlist *rl)
+{
+    int i;
+    int rc;
+    int lenbytes;
+    int ofsbytes;
+    int64_t lcn = 0;
+    uint64_t vcn;
+    uint64_t count;
+    uint64_t delta;
+    uint32_t attrlen;
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+
+    attrlen = ntfs_le32(attr + 4);
+    if (attrlen < 64 || ntfs_le16(attr + 32) >= attrlen)
+    {
+        return -EIO;
+    }
+
+    vcn = ntfs_le64(attr + 16);
+    p = attr + ntfs_le16(attr + 32);
+    end = attr + attrlen;
+
+    while (p < end && *p)
+    {
+        lenbytes = *p & 0x0F;
+        ofsbytes = *p >> 4;
+        if (lenbytes == 0 || lenbytes > 8 || ofsbytes > 8 || p + 1 + lenbytes + ofsbytes > end)
+        {
+            debug("bad mapping pair 0x%02x\n", *p);
+            return -EIO;
+        }
+
+        count = 0;
+        for (i = 0; i < lenbytes; i++)
+        {
+            count |= (uint64_t)p[1 + i] << (i * 8);
+        }
+
+        if (ofsbytes == 0)
+        {
+            rc = vtoy_runlist_add(rl, vcn, VTOY_RUN_HOLE, count);
+        }
+        else
+        {
+            delta = 0;
+            for (i = 0; i < ofsbytes; i++)
+            {
+                delta |= (uint64_t)p[1 + lenbytes + i] << (i * 8);
+            }
+
+            /* the lcn delta is signed */
+            if (ofsbytes < 8 && (p[lenbytes + ofsbytes] & 0x80))
+            {
+                delta |= ~(uint64_t)0 << (ofsbytes * 8);
+            }
+
+            lcn += (int64_t)delta;
+            if (lcn < 0)
+            {
+                return -EIO;
+            }
+            rc = vtoy_runlist_add(rl, vcn, (uint64_t)lcn, count);
+        }
+
+        if (rc)
+        {
+            return rc;
+        }
+
+        vcn += count;
+        p += 1 + lenbytes + ofsbytes;
+    }
+
+    return 0;
+}
+
+/* read len bytes at offset of the stream described by rl */
+static int ntfs_read_runs(ntfs_vol *vol, const vtoy_runlist *rl, uint64_t offset, uint8_t *buf, uint32_t len)
+{
+    int rc;
+    uint32_t lo, hi, mid;
+    uint64_t vcn;
+    uint64_t skip;
+    uint64_t chunk;
+    const vtoy_run *run = NULL;
+
+    while (len > 0)
+    {
+        vcn = offset / vol->cluster_size;
+
+        /* runs are sorted by vcn */
+        lo = 0;
+        hi = rl->count;
+        run = NULL;
+        while (lo < hi)
+        {
+            mid = (lo + hi) / 2;
+            if (vcn < rl->runs[mid].logical)
+            {
+                hi = mid;
+            }
+            else if (vcn >= rl->runs[mid].logical + rl->runs[mid].count)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                run = rl->runs + mid;
+                break;
+            }
+        }
+
+        if (!run)
+        {
+            debug("vcn %llu is not mapped\n", (unsigned long long)vcn);
+            return -EIO;
+        }
+
+        skip = (vcn - run->logical) * vol->cluster_size + offset % vol->cluster_size;
+        chunk = NTFS_MIN((uint64_t)len, run->count * vol->cluster_size - skip);
+
+        if (run->physical == VTOY_RUN_HOLE)
+        {
+            memset(buf, 0, (size_t)chunk);
+        }
+        else
+        {
+            rc = vtoy_pread(vol->fd, buf, (size_t)chunk, run->physical * vol->cluster_size + skip, &vol->reads);
+            if (rc)
+            {
+                return rc;
+            }
+        }
+
+        buf += chunk;
+        offset += chunk;
+        len -= (uint32_t)chunk;
+    }
+
+    return 0;
+}
+
+static int ntfs_read_record(ntfs_vol *vol, uint64_t mftno, uint8_t *buf)
+{
+    int rc;
+
+    rc = ntfs_read_runs(vol, &vol->mft, mftno * vol->record_size, buf, vol->record_size);
+    if (rc)
+    {
+        return rc;
+    }
+
+    rc = ntfs_fixup(buf, vol->record_size, "FILE");
+    if (rc)
+    {
+        debug("bad mft record %llu\n", (unsigned long long)mftno);
+        return rc;
+    }
+
+    if ((ntfs_le16(buf + 22) & 0x0001) == 0)
+    {
+        debug("mft record %llu is not in use\n", (unsigned long long)mftno);
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+/* attribute names are compared case sensitive */
+static int ntfs_name_equal(const uint8_t *raw, const uint16_t *name, int namelen)
+{
+    int i;
+
+    for (i = 0; i < namelen; i++)
+    {
+        if (ntfs_le16(raw + i * 2) != name[i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int ntfs_attr_name_equal(const uint8_t *attr, const uint16_t *name, int namelen)
+{
+    return attr[9] == namelen && ntfs_name_equal(attr + ntfs_le16(attr + 10), name, namelen);
+}
+
+/* find the next attribute of the type and name after prev, NULL to start from the first one */
+static const uint8_t * ntfs_next_attr(ntfs_vol *vol, const uint8_t *rec, const uint8_t *prev,
+                                      uint32_t type, const uint16_t *name, int namelen)
+{
+    uint32_t len;
+    const uint8_t *p = NULL;
+    const uint8_t *end = NULL;
+
+    end = rec + NTFS_MIN(ntfs_le32(rec + 24), vol->record_size);
+    p = prev ? prev + ntfs_le32(prev + 4) : rec + ntfs_le16(rec + 20);
+
+    while (p + 24 <= end && ntfs_le32(p) != NTFS_AT_END)
+    {
+        len = ntfs_le32(p + 4);
+        if (len < 24 || (len & 7) || p + len > end || ntfs_le16(p + 10) + p[9] * 2 > len)
+        {
+            debug("bad attribute length %u\n", len);
+            return NULL;
+        }
+
+        if (ntfs_le32(p) == type && ntfs_attr_name_equal(p, name, namelen))
+        {
+            return p;
+        }
+        p += len;
+    }
+
+    return NULL;
+}
+
+/* read the whole value of an attribute, the caller must free it */
+static uint8_t * ntfs_read_value(ntfs_vol *vol, const uint8_t *attr, uint32_t *len)
+{
+    uint8_t *buf = NULL;
+    uint64_t size;
+    vtoy_runlist rl;
+
+    if (attr[8] == 0)
+    {
+        size = ntfs_le32(attr + 16);
+        if (ntfs_le16(attr + 20) + size > ntfs_le32(attr + 4))
+        {
+            return NULL;
+        }
+
+        buf = (uint8_t *)malloc((size_t)size + 1);
+        if (buf)
+        {
+            memcpy(buf, attr + ntfs_le16(attr + 20), (size_t)size);
+            *len = (uint32_t)size;
+        }
+        return buf;
+    }
+
+    size = ntfs_le64(attr + 48);
+    if (size > NTFS_MAX_LIST_SIZE)
+    {
+        return NULL;
+    }
+
+    memset(&rl, 0, sizeof(rl));
+    buf = (uint8_t *)malloc((size_t)size + 1);
+    if (!buf || ntfs_decode_runs(attr, &rl) || ntfs_read_runs(vol, &rl, 0, buf, (uint32_t)size))
+    {
+        free(buf);
+        buf = NULL;
+    }
+    vtoy_runlist_free(&rl);
+
+    *len = (uint32_t)size;
+    return buf;
+}
+
+/*
+ * Call cb for every piece of the attribute of the type and name in the mft record,
+ * following $ATTRIBUTE_LIST into the extension records when the record has one.
+ */
+static int ntfs_walk_attr(ntfs_vol *vol, uint64_t mftno, uint32_t type, const uint16_t *name, int namelen,
+                          ntfs_attr_cb cb, void *data)
+{
+    int rc;
+    int found = 0;
+    uint32_t listlen = 0;
+    uint32_t entlen;
+    uint64_t ref;
+    uint8_t *list = NULL;
+    const uint8_t *rec = NULL;
+    const uint8_t *attr = NULL;
+    const uint8_t *ent = NULL;
+
+    rc = ntfs_read_record(vol, mftno, vol->record);
+    if (rc)
+    {
+        return rc;
+    }
+
+    attr = ntfs_next_attr(vol, vol->record, NULL, NTFS_AT_ATTRIBUTE_LIST, NULL, 0);
+    if (!attr)
+    {
+        for (attr = ntfs_next_attr(vol, vol->record, NULL, type, name, namelen); attr;
+             attr = ntfs_next_attr(vol, vol->record, attr, type, name, namelen))
+        {
+            rc = cb(vol, attr, data);
+            if (rc)
+            {
+                return rc;
+            }
+            found = 1;
+        }
+        return found ? 0 : -ENOENT;
+    }
+
+    list = ntfs_read_value(vol, attr, &listlen);
+    if (!list)
+    {
+        debug("failed to read attribute list of %llu\n", (unsigned long long)mftno);
+        return -EIO;
+    }
+
+    for (ent = list; ent + 26 <= list + listlen; ent += entlen)
+    {
+        entlen = ntfs_le16(ent + 4);
+        if (entlen < 26 || ent + entlen > list + listlen || ent[7] + ent[6] * 2 > entlen)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        if (ntfs_le32(ent) != type || ent[6] != namelen || !ntfs_name_equal(ent + ent[7], name, namelen))
+        {
+            continue;
+        }
+
+        ref = ntfs_le64(ent + 16) & NTFS_MFT_REF_MASK;
+        rec = vol->record;
+        if (ref != mftno)
+        {
+            rc = ntfs_read_record(vol, ref, vol->extrecord);
+            if (rc)
+            {
+                break;
+            }
+            rec = vol->extrecord;
+        }
+
+        /* the attribute instance identifies the piece in that record */
+        for (attr = ntfs_next_attr(vol, rec, NULL, type, name, namelen); attr;
+             attr = ntfs_next_attr(vol, rec, attr, type, name, namelen))
+        {
+            if (ntfs_le16(attr + 14) == ntfs_le16(ent + 24))
+            {
+                break;
+            }
+        }
+
+        if (!attr)
+        {
+            debug("attribute 0x%x missing in record %llu\n", type, (unsigned long long)ref);
+            rc = -EIO;
+            break;
+        }
+
+        rc = cb(vol, attr, data);
+        if (rc)
+        {
+            break;
+        }
+        found = 1;
+    }
+
+    free(list);
+
+    if (rc)
+    {
+        return rc;
+    }
+    return found ? 0 : -ENOENT;
+}
+
+static int ntfs_runs_cb(ntfs_vol *vol, const uint8_t *attr, void *data)
+{
+    vtoy_runlist *rl = (vtoy_runlist *)data;
+
+    (void)vol;
+
+    if (attr[8] == 0)
+    {
+        rl->resident = 1;
+        rl->size = ntfs_le32(attr + 16);
+        rl->flags = ntfs_le16(attr + 12);
+        return 0;
+    }
+
+    /* data size and flags are only valid in the first piece */
+    if (ntfs_le64(attr + 16) == 0)
+    {
+        rl->size = ntfs_le64(attr + 48);
+        rl->flags = ntfs_le16(attr + 12);
+    }
+
+    return ntfs_decode_runs(attr, rl);
+}
+
+static int ntfs_value_cb(ntfs_vol *vol, const uint8_t *attr, void *data)
+{
+    ntfs_value *value = (ntfs_value *)data;
+
+    if (value->buf)
+    {
+        return 0;
+    }
+
+    value->buf = ntfs_read_value(vol, attr, &value->len);
+    return value->buf ? 0 : -EIO;
+}
+
+int ntfs_get_runs(ntfs_vol *vol, uint64_t mftno, uint32_t type, const uint16_t *name, int namelen, vtoy_runlist *rl)
+{
+    int rc;
+
+    memset(rl, 0, sizeof(vtoy_runlist));
+    rc = ntfs_walk_attr(vol, mftno, type, name, namelen, ntfs_runs_cb, rl);
+    if (rc)
+    {
+        vtoy_runlist_free(rl);
+    }
+
+    return rc;
+}
+
+static uint16_t ntfs_upcase(ntfs_vol *vol, uint16_t c)
+{
+    if (vol->upcase && c < vol->upcase_len)
+    {
+        return vol->upcase[c];
+    }
+
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 'A';
+    }
+    return c;
+}
+
+/* file name collation, names are compared in upper case */
+static int ntfs_name_cmp(ntfs_vol *vol, const uint16_t *name, int namelen, const uint8_t *key, int keylen)
+{
+    int i;
+    uint16_t a, b;
+
+    for (i = 0; i < namelen && i < keylen; i++)
+    {
+        a = ntfs_upcase(vol, name[i]);
+        b = ntfs_upcase(vol, ntfs_le16(key + i * 2));
+        if (a != b)
+        {
+            return a < b ? -1 : 1;
+        }
+    }
+
+    return namelen - keylen;
+}
+
+/*
+ * Search the entries of one index node.
+ * Return 0 and set mftno if found, 1 and set vcn if the name can only be in
+ * the sub node at vcn, -ENOENT if it does not exist.
+ */
+static int ntfs_search_node(ntfs_vol *vol, const uint8_t *entry, const uint8_t *end,
+                            const uint16_t *name, int namelen, uint64_t *mftno, uint64_t *vcn)
+{
+    int cmp;
+    uint16_t len;
+    uint16_t keylen;
+    uint16_t flags;
+
+    while (entry + 16 <= end)
+    {
+        len = ntfs_le16(entry + 8);
+        keylen = ntfs_le16(entry + 10);
+        flags = ntfs_le16(entry + 12);
+        if (len < 16 || entry + len > end)
+        {
+            break;
+        }
+
+        if ((flags & NTFS_INDEX_ENTRY_END) == 0)
+        {
+            /* the key is a $FILE_NAME */
+            if (keylen < 66 || 16 + keylen > len || 66 + entry[16 + 64] * 2 > keylen)
+            {
+                break;
+            }
+
+            cmp = ntfs_name_cmp(vol, name, namelen, entry + 16 + 66, entry[16 + 64]);
+            if (cmp == 0)
+            {
+                *mftno = ntfs_le64(entry) & NTFS_MFT_REF_MASK;
+                return 0;
+            }
+            else if (cmp > 0)
+            {
+                entry += len;
+                continue;
+            }
+        }
+
+        if ((flags & NTFS_INDEX_ENTRY_NODE) == 0)
+        {
+            return -ENOENT;
+        }
+
+        if (len < 24)
+        {
+            break;
+        }
+
+        *vcn = ntfs_le64(entry + len - 8);
+        return 1;
+    }
+
+    debug("bad index entry\n");
+    return -EIO;
+}
+
+/* B+ tree search of the $I30 index of a directory */
+static int ntfs_find_in_dir(ntfs_vol *vol, uint64_t dirno, const uint16_t *name, int namelen, uint64_t *childno)
+{
+    int rc;
+    int depth;
+    uint32_t blocksize;
+    uint32_t vcnsize;
+    uint64_t vcn = 0;
+    uint8_t *block = NULL;
+    const uint8_t *hdr = NULL;
+    ntfs_value root;
+    vtoy_runlist alloc;
+
+    memset(&root, 0, sizeof(root));
+    memset(&alloc, 0, sizeof(alloc));
+
+    rc = ntfs_walk_attr(vol, dirno, NTFS_AT_INDEX_ROOT, ntfs_i30, 4, ntfs_value_cb, &root);
+    if (rc)
+    {
+        return rc == -ENOENT ? -ENOTDIR : rc;
+    }
+
+    if (root.len < 32 || 16 + ntfs_le32(root.buf + 20) > root.len)
+    {
+        rc = -EIO;
+        goto end;
+    }
+
+    blocksize = ntfs_le32(root.buf + 8);
+    hdr = root.buf + 16;
+    rc = ntfs_search_node(vol, hdr + ntfs_le32(hdr), hdr + ntfs_le32(hdr + 4), name, namelen, childno, &vcn);
+
+    for (depth = 0; rc == 1; depth++)
+    {
+        if (depth >= NTFS_MAX_DEPTH)
+        {
+            rc = -EIO;
+            break;
+        }
+
+        if (!block)
+        {
+            if (blocksize < 512 || blocksize > 65536 || (blocksize & 511))
+            {
+                debug("bad index block size %u\n", blocksize);
+                rc = -EIO;
+                break;
+            }
+
+            rc = ntfs_get_runs(vol, dirno, NTFS_AT_INDEX_ALLOCATION, ntfs_i30, 4, &alloc);
+            block = (uint8_t *)malloc(blocksize);
+            if (rc || !block)
+            {
+                rc = rc ? rc : -ENOMEM;
+                break;
+            }
+        }
+
+        /* vcn of index blocks smaller than a cluster is in 512 byte units */
+        vcnsize = blocksize >= vol->cluster_size ? vol->cluster_size : 512;
+        rc = ntfs_read_runs(vol, &alloc, vcn * vcnsize, block, blocksize);
+        if (rc == 0)
+        {
+            rc = ntfs_fixup(block, blocksize, "INDX");
+        }
+        if (rc)
+        {
+            break;
+        }
+
+        hdr = block + 24;
+        if (24 + ntfs_le32(hdr + 4) > blocksize)
+        {
+            rc = -EIO;
+            break;
+        }
+        rc = ntfs_search_node(vol, hdr + ntfs_le32(hdr), hdr + ntfs_le32(hdr + 4), name, namelen, childno, &vcn);
+    }
+
+end:
+    free(block);
+    free(root.buf);
+    vtoy_runlist_free(&alloc);
+    return rc;
+}
+
+/* utf-8 to utf-16, return the count of utf-16 units or -1 */
+static int ntfs_utf8_to_utf16(const char *in, int inlen, uint16_t *out, int outmax)
+{
+    int i = 0;
+    int n = 0;
+    int more;
+    uint32_t c;
+
+    while (i < inlen)
+    {
+        c = (uint8_t)in[i++];
+        if (c < 0x80)
+        {
+            more = 0;
+        }
+        else if ((c & 0xE0) == 0xC0)
+        {
+            c &= 0x1F;
+            more = 1;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            c &= 0x0F;
+            more = 2;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            c &= 0x07;
+            more = 3;
+        }
+        else
+        {
+            return -1;
+        }
+
+        for (; more > 0; more--)
+        {
+            if (i >= inlen || ((uint8_t)in[i] & 0xC0) != 0x80)
+            {
+                return -1;
+            }
+            c = (c << 6) | ((uint8_t)in[i++] & 0x3F);
+        }
+
+        if (c >= 0x10000)
+        {
+            if (n + 2 > outmax)
+            {
+                return -1;
+            }
+            c -= 0x10000;
+            out[n++] = (uint16_t)(0xD800 | (c >> 10));
+            out[n++] = (uint16_t)(0xDC00 | (c & 0x3FF));
+        }
+        else
+        {
+            if (n + 1 > outmax)
+            {
+                return -1;
+            }
+            out[n++] = (uint16_t)c;
+        }
+    }
+
+    return n;
+}
+
+/* vtoy_find_child of ntfs, the index is searched with the utf-16 name */
+static int ntfs_find_child(void *arg, uint64_t dirno, const char *name, int namelen, uint64_t *childno)
+{
+    int len;
+    uint16_t uname[NTFS_NAME_MAX];
+
+    len = ntfs_utf8_to_utf16(name, namelen, uname, NTFS_NAME_MAX);
+    if (len <= 0)
+    {
+        return -EINVAL;
+    }
+
+    return ntfs_find_in_dir((ntfs_vol *)arg, dirno, uname, len, childno);
+}
+
+int ntfs_lookup(ntfs_vol *vol, const char *path, uint64_t *mftno)
+{
+    return vtoy_walk_path(vol, NTFS_MFT_RECORD_ROOT, path, ntfs_find_child, mftno);
+}
+
+static void ntfs_load_upcase(ntfs_vol *vol)
+{
+    uint32_t i;
+    uint8_t *buf = NULL;
+    vtoy_runlist rl;
+
+    if (ntfs_get_runs(vol, NTFS_MFT_RECORD_UPCASE, NTFS_AT_DATA, NULL, 0, &rl))
+    {
+        debug("failed to get $UpCase, use ascii upcase\n");
+        return;
+    }
+
+    if (rl.resident || rl.size < 256 || rl.size > 131072)
+    {
+        vtoy_runlist_free(&rl);
+        return;
+    }
+
+    buf = (uint8_t *)malloc((size_t)rl.size);
+    vol->upcase = (uint16_t *)malloc((size_t)rl.size);
+    if (buf && vol->upcase && ntfs_read_runs(vol, &rl, 0, buf, (uint32_t)rl.size) == 0)
+    {
+        vol->upcase_len = (uint32_t)(rl.size / 2);
+        for (i = 0; i < vol->upcase_len; i++)
+        {
+            vol->upcase[i] = ntfs_le16(buf + i * 2);
+        }
+    }
+    else
+    {
+        free(vol->upcase);
+        vol->upcase = NULL;
+    }
+
+    free(buf);
+    vtoy_runlist_free(&rl);
+}
+
+int ntfs_mount(ntfs_vol *vol, const char *devpath)
+{
+    int rc;
+    int8_t size;
+    uint8_t spc;
+    uint8_t boot[512];
+    const uint8_t *attr = NULL;
+    vtoy_runlist rl;
+
+    memset(vol, 0, sizeof(ntfs_vol));
+
+    vol->fd = open(devpath, O_RDONLY);
+    if (vol->fd < 0)
+    {
+        debug("failed to open %s %d\n", devpath, errno);
+        return -errno;
+    }
+
+    rc = vtoy_pread(vol->fd, boot, sizeof(boot), 0, &vol->reads);
+    if (rc)
+    {
+        goto fail;
+    }
+
+    if (memcmp(boot + 3, "NTFS    ", 8) || ntfs_le16(boot + 510) != 0xAA55)
+    {
+        debug("%s is not ntfs\n", devpath);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    vol->sector_size = ntfs_le16(boot + 11);
+    spc = boot[13];
+    vol->cluster_size = (spc > 0x80) ? (vol->sector_size << (256 - spc)) : (vol->sector_size * spc);
+
+    size = (int8_t)boot[0x40];
+    vol->record_size = (size > 0) ? (uint32_t)size * vol->cluster_size : (1U << -size);
+    vol->mft_lcn = ntfs_le64(boot + 0x30);
+
+    if (vol->sector_size < 256 || vol->sector_size > 4096 || (vol->sector_size & (vol->sector_size - 1)) ||
+        vol->cluster_size == 0 || vol->cluster_size > 0x200000 ||
+        vol->record_size < 512 || vol->record_size > 65536 || (vol->record_size & 511))
+    {
+        debug("bad ntfs geometry %u %u %u\n", vol->sector_size, vol->cluster_size, vol->record_size);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    vol->record = (uint8_t *)malloc(vol->record_size);
+    vol->extrecord = (uint8_t *)malloc(vol->record_size);
+    if (!vol->record || !vol->extrecord)
+    {
+        rc = -ENOMEM;
+        goto fail;
+    }
+
+    /* the first record of $MFT is at mft_lcn, it maps the rest of $MFT */
+    rc = vtoy_pread(vol->fd, vol->record, vol->record_size, vol->mft_lcn * vol->cluster_size, &vol->reads);
+    if (rc == 0)
+    {
+        rc = ntfs_fixup(vol->record, vol->record_size, "FILE");
+    }
+    if (rc)
+    {
+        goto fail;
+    }
+
+    attr = ntfs_next_attr(vol, vol->record, NULL, NTFS_AT_DATA, NULL, 0);
+    if (!attr || attr[8] == 0)
+    {
+        debug("bad $MFT record\n");
+        rc = -EIO;
+        goto fail;
+    }
+
+    rc = ntfs_decode_runs(attr, &vol->mft);
+    if (rc)
+    {
+        goto fail;
+    }
+
+    /* a fragmented $MFT continues its runs in extension records */
+    if (ntfs_next_attr(vol, vol->record, NULL, NTFS_AT_ATTRIBUTE_LIST, NULL, 0))
+    {
+        rc = ntfs_get_runs(vol, NTFS_MFT_RECORD_MFT, NTFS_AT_DATA, NULL, 0, &rl);
+        if (rc)
+        {
+            goto fail;
+        }
+        vtoy_runlist_free(&vol->mft);
+        vol->mft = rl;
+    }
+
+    ntfs_load_upcase(vol);
+
+    debug("ntfs cluster %u record %u mft runs %u\n", vol->cluster_size, vol->record_size, vol->mft.count);
+    return 0;
+
+fail:
+    ntfs_unmount(vol);
+    return rc;
+}
+
+void ntfs_unmount(ntfs_vol *vol)
+{
+    if (vol->fd >= 0)
+    {
+        close(vol->fd);
+    }
+
+    vtoy_runlist_free(&vol->mft);
+    free(vol->upcase);
+    free(vol->record);
+    free(vol->extrecord);
+    memset(vol, 0, sizeof(ntfs_vol));
+    vol->fd = -1;
+}
@@ -0,0 +1,78 @@
+/******************************************************************************
+ * ntfs.h  ---- read only NTFS parser used to get the file blocklist
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __NTFS_H__
+#define __NTFS_H__
+
+#include <stdint.h>
+#include <vtoyloc.h>
+
+#define NTFS_MFT_RECORD_MFT     0
+#define NTFS_MFT_RECORD_ROOT    5
+#define NTFS_MFT_RECORD_UPCASE  10
+
+#define NTFS_AT_ATTRIBUTE_LIST  0x20
+#define NTFS_AT_FILE_NAME       0x30
+#define NTFS_AT_DATA            0x80
+#define NTFS_AT_INDEX_ROOT      0x90
+#define NTFS_AT_INDEX_ALLOCATION 0xA0
+#define NTFS_AT_END             0xFFFFFFFF
+
+#define NTFS_ATTR_COMPRESSED    0x0001
+#define NTFS_ATTR_ENCRYPTED     0x4000
+#define NTFS_ATTR_SPARSE        0x8000
+
+typedef struct ntfs_vol
+{
+    int fd;
+    uint32_t sector_size;
+    uint32_t cluster_size;
+    uint32_t record_size;
+    uint64_t mft_lcn;
+    vtoy_runlist mft;       // runs of $MFT:$DATA
+    uint16_t *upcase;       // $UpCase table, NULL if not loaded
+    uint32_t upcase_len;
+    uint8_t *record;        // scratch buffer of one mft record
+    uint8_t *extrecord;     // scratch buffer for extension records
+    uint32_t reads;         // count of disk reads, for debug
+}ntfs_vol;
+
+static inline uint16_t ntfs_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t ntfs_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t ntfs_le64(const uint8_t *p)
+{
+    return (uint64_t)ntfs_le32(p) | ((uint64_t)ntfs_le32(p + 4) << 32);
+}
+
+int ntfs_mount(ntfs_vol *vol, const char *devpath);
+void ntfs_unmount(ntfs_vol *vol);
+int ntfs_lookup(ntfs_vol *vol, const char *path, uint64_t *mftno);
+/* free the list with vtoy_runlist_free() */
+int ntfs_get_runs(ntfs_vol *vol, uint64_t mftno, uint32_t type, const uint16_t *name, int namelen, vtoy_runlist *rl);
+
+#endif
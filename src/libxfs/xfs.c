@@ -0,0 +1,591 @@
+/******************************************************************************
+ * xfs.c  ---- read only XFS parser used to get the file blocklist
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <xfs.h>
+
+#define XFS_MIN(a, b)           ((a) < (b) ? (a) : (b))
+#define XFS_SB_MAGIC            0x58465342  /* XFSB */
+#define XFS_DINODE_MAGIC        0x494E      /* IN */
+#define XFS_BMAP_MAGIC          0x424D4150  /* BMAP */
+#define XFS_BMAP_CRC_MAGIC      0x424D4133  /* BMA3 */
+#define XFS_DIR2_BLOCK_MAGIC    0x58443242  /* XD2B */
+#define XFS_DIR2_DATA_MAGIC     0x58443244  /* XD2D */
+#define XFS_DIR3_BLOCK_MAGIC    0x58444233  /* XDB3 */
+#define XFS_DIR3_DATA_MAGIC     0x58444433  /* XDD3 */
+
+#define XFS_SB_VERSION_NUMBITS  0x000F
+#define XFS_SB_VERSION2_FTYPE   0x00000200
+#define XFS_SB_FEAT_INCOMPAT_FTYPE      0x0001
+#define XFS_SB_FEAT_INCOMPAT_NREXT64    0x0020
+
+#define XFS_DIFLAG2_NREXT64     0x0010
+
+#define XFS_DINODE_FMT_LOCAL    1
+#define XFS_DINODE_FMT_EXTENTS  2
+#define XFS_DINODE_FMT_BTREE    3
+
+/* directory data blocks live below this byte offset, leaf and free blocks above */
+#define XFS_DIR2_LEAF_OFFSET    (1ULL << 35)
+
+#define XFS_MAX_BTREE_LEVEL     9
+#define XFS_MAX_DIR_SIZE        (64 * 1024 * 1024)
+#define XFS_NAME_MAX            255
+
+/* adjacent bmap btree blocks are read together, at most this many blocks */
+#define XFS_BATCH_BLOCKS        64
+
+/* filesystem block number (agno:agbno) to block number on the device */
+static int xfs_fsb_to_blk(xfs_vol *vol, uint64_t fsb, uint64_t *blk)
+{
+    uint64_t agno = fsb >> vol->agblklog;
+    uint64_t agbno = fsb & ((1ULL << vol->agblklog) - 1);
+
+    if (agno >= vol->agcount || agbno >= vol->agblocks)
+    {
+        debug("bad fs block 0x%llx\n", (unsigned long long)fsb);
+        return -EIO;
+    }
+
+    *blk = agno * vol->agblocks + agbno;
+    return 0;
+}
+
+/* decode packed 128 bit bmbt records */
+static int xfs_decode_recs(xfs_vol *vol, const uint8_t *rec, uint32_t count, vtoy_runlist *list)
+{
+    int rc;
+    uint32_t i;
+    uint64_t l0, l1;
+    uint64_t blk;
+
+    for (i = 0; i < count; i++, rec += 16)
+    {
+        l0 = xfs_be64(rec);
+        l1 = xfs_be64(rec + 8);
+
+        rc = xfs_fsb_to_blk(vol, ((l0 & 0x1FF) << 43) | (l1 >> 21), &blk);
+        if (rc == 0)
+        {
+            /* the top bit flags unwritten extents */
+            rc = vtoy_runlist_add(list, (l0 & 0x7FFFFFFFFFFFFFFFULL) >> 9, (l0 >> 63) ? VTOY_RUN_HOLE : blk, l1 & 0x1FFFFF);
+        }
+
+        if (rc)
+        {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+/* read the children of a bmbt node, runs of adjacent child blocks are read with one pread */
+static int xfs_walk_ptrs(xfs_vol *vol, const uint8_t *ptrs, uint32_t count, int level, vtoy_runlist *list);
+
+static int xfs_walk_block(xfs_vol *vol, const uint8_t *block, int level, vtoy_runlist *list)
+{
+    uint32_t hdr;
+    uint32_t magic;
+    uint32_t numrecs;
+    uint32_t maxrecs;
+
+    magic = xfs_be32(block);
+    hdr = (magic == XFS_BMAP_CRC_MAGIC) ? 72 : 24;
+    numrecs = xfs_be16(block + 6);
+
+    if ((magic != XFS_BMAP_MAGIC && magic != XFS_BMAP_CRC_MAGIC) || xfs_be16(block + 4) != level)
+    {
+        debug("bad bmbt block level %d\n", level);
+        return -EIO;
+    }
+
+    /* leaves hold 16 byte records, nodes hold 8 byte keys followed by 8 byte pointers */
+    maxrecs = (vol->block_size - hdr) / 16;
+    if (numrecs > maxrecs)
+    {
+        return -EIO;
+    }
+
+    if (level == 0)
+    {
+        return xfs_decode_recs(vol, block + hdr, numrecs, list);
+    }
+
+    return xfs_walk_ptrs(vol, block + hdr + maxrecs * 8, numrecs, level - 1, list);
+}
+
+static int xfs_walk_ptrs(xfs_vol *vol, const uint8_t *ptrs, uint32_t count, int level, vtoy_runlist *list)
+{
+    int rc = 0;
+    uint32_t i;
+    uint32_t k;
+    uint32_t run;
+    uint64_t blk;
+    uint64_t next;
+    uint8_t *buf = NULL;
+
+    buf = (uint8_t *)malloc((size_t)vol->block_size * XFS_BATCH_BLOCKS);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < count && rc == 0; i += run)
+    {
+        rc = xfs_fsb_to_blk(vol, xfs_be64(ptrs + i * 8), &blk);
+
+        for (run = 1; rc == 0 && i + run < count && run < XFS_BATCH_BLOCKS; run++)
+        {
+            if (xfs_fsb_to_blk(vol, xfs_be64(ptrs + (i + run) * 8), &next) || next != blk + run)
+            {
+                break;
+            }
+        }
+
+        if (rc == 0)
+        {
+            rc = vtoy_pread(vol->fd, buf, (size_t)run * vol->block_size, blk * vol->block_size, &vol->reads);
+        }
+
+        for (k = 0; k < run && rc == 0; k++)
+        {
+            rc = xfs_walk_block(vol, buf + (size_t)k * vol->block_size, level, list);
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+/* read an inode, the caller must free it */
+static uint8_t * xfs_read_inode(xfs_vol *vol, uint64_t ino)
+{
+    uint64_t agno;
+    uint64_t agbno;
+    uint64_t offset;
+    uint8_t *inode = NULL;
+
+    agno = ino >> (vol->agblklog + vol->inopblog);
+    agbno = (ino >> vol->inopblog) & ((1ULL << vol->agblklog) - 1);
+    offset = ino & ((1ULL << vol->inopblog) - 1);
+    if (agno >= vol->agcount || agbno >= vol->agblocks)
+    {
+        debug("bad inode number %llu\n", (unsigned long long)ino);
+        return NULL;
+    }
+
+    inode = (uint8_t *)malloc(vol->inode_size);
+    if (!inode)
+    {
+        return NULL;
+    }
+
+    if (vtoy_pread(vol->fd, inode, vol->inode_size, (agno * vol->agblocks + agbno) * vol->block_size + offset * vol->inode_size,
+                   &vol->reads) ||
+        xfs_be16(inode) != XFS_DINODE_MAGIC)
+    {
+        debug("bad inode %llu\n", (unsigned long long)ino);
+        free(inode);
+        return NULL;
+    }
+
+    return inode;
+}
+
+/* data fork of the inode */
+static const uint8_t * xfs_data_fork(xfs_vol *vol, const uint8_t *inode, uint32_t *forksize)
+{
+    uint32_t core = (inode[4] >= 3) ? 176 : 100;
+
+    *forksize = inode[82] ? inode[82] * 8U : vol->inode_size - core;
+    if (core + *forksize > vol->inode_size)
+    {
+        *forksize = 0;
+    }
+
+    return inode + core;
+}
+
+static int xfs_inode_extents(xfs_vol *vol, const uint8_t *inode, vtoy_runlist *list)
+{
+    int level;
+    uint32_t forksize;
+    uint32_t maxrecs;
+    uint64_t nextents;
+    const uint8_t *fork = NULL;
+
+    fork = xfs_data_fork(vol, inode, &forksize);
+    /* only inodes flagged in di_flags2 use the 64 bit counter, older ones keep the 32 bit one */
+    if (vol->nrext64 && inode[4] >= 3 && (xfs_be64(inode + 120) & XFS_DIFLAG2_NREXT64))
+    {
+        nextents = xfs_be64(inode + 24);
+    }
+    else
+    {
+        nextents = xfs_be32(inode + 76);
+    }
+
+    if (inode[5] == XFS_DINODE_FMT_EXTENTS)
+    {
+        if (nextents * 16 > forksize)
+        {
+            return -EIO;
+        }
+        return xfs_decode_recs(vol, fork, (uint32_t)nextents, list);
+    }
+    else if (inode[5] == XFS_DINODE_FMT_BTREE)
+    {
+        /* the btree root in the inode has a 4 byte header, then keys and pointers */
+        level = xfs_be16(fork);
+        maxrecs = (forksize - 4) / 16;
+        if (forksize < 20 || level == 0 || level > XFS_MAX_BTREE_LEVEL || xfs_be16(fork + 2) > maxrecs)
+        {
+            return -EIO;
+        }
+        return xfs_walk_ptrs(vol, fork + 4 + maxrecs * 8, xfs_be16(fork + 2), level - 1, list);
+    }
+
+    debug("inode format %d has no extents\n", inode[5]);
+    return -ENOTSUP;
+}
+
+int xfs_get_extents(xfs_vol *vol, uint64_t ino, vtoy_runlist *list)
+{
+    int rc;
+    uint8_t *inode = NULL;
+
+    memset(list, 0, sizeof(vtoy_runlist));
+
+    inode = xfs_read_inode(vol, ino);
+    if (!inode)
+    {
+        return -EIO;
+    }
+
+    list->mode = xfs_be16(inode + 2);
+    list->size = xfs_be64(inode + 56);
+    list->flags = xfs_be16(inode + 90);
+
+    rc = xfs_inode_extents(vol, inode, list);
+    if (rc)
+    {
+        vtoy_runlist_free(list);
+    }
+
+    free(inode);
+    return rc;
+}
+
+static int xfs_name_match(const uint8_t *entname, uint32_t entlen, const char *name, int namelen)
+{
+    return entlen == (uint32_t)namelen && memcmp(entname, name, namelen) == 0;
+}
+
+/* short form directory stored in the inode */
+static int xfs_search_sf(xfs_vol *vol, const uint8_t *fork, uint32_t forksize, const char *name, int namelen, uint64_t *child)
+{
+    uint32_t i;
+    uint32_t pos;
+    uint32_t inolen;
+    uint32_t entlen;
+
+    if (forksize < 6)
+    {
+        return -EIO;
+    }
+
+    inolen = fork[1] ? 8 : 4;
+    pos = 2 + inolen;
+
+    for (i = 0; i < fork[0]; i++)
+    {
+        /* namelen, 2 byte offset, name, file type, inode number */
+        entlen = 3 + fork[pos] + (vol->ftype ? 1 : 0) + inolen;
+        if (pos + entlen > forksize)
+        {
+            return -EIO;
+        }
+
+        if (xfs_name_match(fork + pos + 3, fork[pos], name, namelen))
+        {
+            pos += entlen - inolen;
+            *child = (inolen == 8) ? xfs_be64(fork + pos) : xfs_be32(fork + pos);
+            return 0;
+        }
+        pos += entlen;
+    }
+
+    return -ENOENT;
+}
+
+/* one directory data block, single block directories keep the leaf and a tail at the end */
+static int xfs_search_data(xfs_vol *vol, const uint8_t *block, const char *name, int namelen, uint64_t *child)
+{
+    uint32_t pos;
+    uint32_t end;
+    uint32_t len;
+    uint32_t magic;
+
+    magic = xfs_be32(block);
+    if (magic == 0)
+    {
+        /* hole in the directory */
+        return -ENOENT;
+    }
+
+    if (magic == XFS_DIR2_BLOCK_MAGIC || magic == XFS_DIR2_DATA_MAGIC)
+    {
+        pos = 16;
+    }
+    else if (magic == XFS_DIR3_BLOCK_MAGIC || magic == XFS_DIR3_DATA_MAGIC)
+    {
+        pos = 64;
+    }
+    else
+    {
+        debug("bad directory block magic 0x%x\n", magic);
+        return -EIO;
+    }
+
+    end = vol->dirblk_size;
+    if (magic == XFS_DIR2_BLOCK_MAGIC || magic == XFS_DIR3_BLOCK_MAGIC)
+    {
+        len = xfs_be32(block + vol->dirblk_size - 8);
+        if ((uint64_t)len * 8 + 8 + pos > vol->dirblk_size)
+        {
+            return -EIO;
+        }
+        end = vol->dirblk_size - 8 - len * 8;
+    }
+
+    while (pos + 8 <= end)
+    {
+        if (xfs_be16(block + pos) == 0xFFFF)
+        {
+            /* unused space */
+            len = xfs_be16(block + pos + 2);
+        }
+        else
+        {
+            /* inumber, namelen, name, file type, tag, 8 bytes aligned */
+            len = (8 + 1 + block[pos + 8] + (vol->ftype ? 1 : 0) + 2 + 7) & ~7U;
+            if (pos + len <= end && xfs_name_match(block + pos + 9, block[pos + 8], name, namelen))
+            {
+                *child = xfs_be64(block + pos);
+                return 0;
+            }
+        }
+
+        if (len < 8 || (len & 7) || pos + len > end)
+        {
+            debug("bad directory entry at %u\n", pos);
+            return -EIO;
+        }
+        pos += len;
+    }
+
+    return -ENOENT;
+}
+
+/* vtoy_find_child of the xfs volume */
+static int xfs_find_in_dir(void *arg, uint64_t dirino, const char *name, int namelen, uint64_t *child)
+{
+    int rc;
+    uint32_t i;
+    uint32_t forksize;
+    uint64_t pos;
+    uint64_t blocks;
+    uint64_t datasize = 0;
+    uint8_t *inode = NULL;
+    uint8_t *data = NULL;
+    const uint8_t *fork = NULL;
+    vtoy_run *ext = NULL;
+    xfs_vol *vol = (xfs_vol *)arg;
+    vtoy_runlist list;
+
+    if (namelen > XFS_NAME_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+
+    memset(&list, 0, sizeof(list));
+
+    inode = xfs_read_inode(vol, dirino);
+    if (!inode)
+    {
+        return -EIO;
+    }
+
+    if ((xfs_be16(inode + 2) & 0xF000) != 0x4000)
+    {
+        free(inode);
+        return -ENOTDIR;
+    }
+
+    if (inode[5] == XFS_DINODE_FMT_LOCAL)
+    {
+        fork = xfs_data_fork(vol, inode, &forksize);
+        rc = xfs_search_sf(vol, fork, forksize, name, namelen, child);
+        free(inode);
+        return rc;
+    }
+
+    rc = xfs_inode_extents(vol, inode, &list);
+    free(inode);
+    if (rc)
+    {
+        return rc;
+    }
+
+    /* read the data blocks of the directory at their logical offsets, one pread per extent */
+    blocks = XFS_DIR2_LEAF_OFFSET >> vol->blocklog;
+    for (i = 0; i < list.count; i++)
+    {
+        ext = list.runs + i;
+        if (ext->logical < blocks && ((ext->logical + XFS_MIN(ext->count, blocks - ext->logical)) << vol->blocklog) > datasize)
+        {
+            datasize = (ext->logical + XFS_MIN(ext->count, blocks - ext->logical)) << vol->blocklog;
+        }
+    }
+
+    datasize = (datasize + vol->dirblk_size - 1) / vol->dirblk_size * vol->dirblk_size;
+    if (datasize > XFS_MAX_DIR_SIZE)
+    {
+        vtoy_runlist_free(&list);
+        return -EFBIG;
+    }
+
+    data = (uint8_t *)calloc(1, (size_t)datasize + 1);
+    if (!data)
+    {
+        vtoy_runlist_free(&list);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < list.count && rc == 0; i++)
+    {
+        ext = list.runs + i;
+        if (ext->logical < blocks && ext->physical != VTOY_RUN_HOLE)
+        {
+            rc = vtoy_pread(vol->fd, data + (ext->logical << vol->blocklog),
+                            (size_t)(XFS_MIN(ext->count, blocks - ext->logical) << vol->blocklog),
+                            ext->physical << vol->blocklog, &vol->reads);
+        }
+    }
+
+    for (pos = 0, rc = rc ? rc : -ENOENT; pos < datasize && rc == -ENOENT; pos += vol->dirblk_size)
+    {
+        rc = xfs_search_data(vol, data + pos, name, namelen, child);
+    }
+
+    free(data);
+    vtoy_runlist_free(&list);
+    return rc;
+}
+
+int xfs_lookup(xfs_vol *vol, const char *path, uint64_t *ino)
+{
+    return vtoy_walk_path(vol, vol->rootino, path, xfs_find_in_dir, ino);
+}
+
+int xfs_mount(xfs_vol *vol, const char *devpath)
+{
+    int rc;
+    uint8_t sb[512];
+
+    memset(vol, 0, sizeof(xfs_vol));
+
+    vol->fd = open(devpath, O_RDONLY);
+    if (vol->fd < 0)
+    {
+        debug("failed to open %s %d\n", devpath, errno);
+        return -errno;
+    }
+
+    rc = vtoy_pread(vol->fd, sb, sizeof(sb), 0, &vol->reads);
+    if (rc)
+    {
+        goto fail;
+    }
+
+    if (xfs_be32(sb) != XFS_SB_MAGIC)
+    {
+        debug("%s is not xfs\n", devpath);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    vol->block_size = xfs_be32(sb + 4);
+    vol->rootino = xfs_be64(sb + 56);
+    vol->agblocks = xfs_be32(sb + 84);
+    vol->agcount = xfs_be32(sb + 88);
+    vol->inode_size = xfs_be16(sb + 104);
+    vol->blocklog = sb[120];
+    vol->inopblog = sb[123];
+    vol->agblklog = sb[124];
+    vol->v5 = (xfs_be16(sb + 100) & XFS_SB_VERSION_NUMBITS) == 5;
+
+    if (vol->v5)
+    {
+        vol->ftype = (xfs_be32(sb + 216) & XFS_SB_FEAT_INCOMPAT_FTYPE) ? 1 : 0;
+        vol->nrext64 = (xfs_be32(sb + 216) & XFS_SB_FEAT_INCOMPAT_NREXT64) ? 1 : 0;
+    }
+    else
+    {
+        vol->ftype = (xfs_be32(sb + 200) & XFS_SB_VERSION2_FTYPE) ? 1 : 0;
+    }
+
+    if (vol->blocklog < 9 || vol->blocklog > 16 || vol->block_size != (1U << vol->blocklog) ||
+        sb[192] > 8 || vol->agblklog > 31 || vol->agblocks == 0 || vol->agblocks > (1U << vol->agblklog) ||
+        vol->inode_size < 256 || vol->inode_size > vol->block_size ||
+        vol->inode_size << vol->inopblog != vol->block_size)
+    {
+        debug("bad xfs geometry %u %u %u\n", vol->block_size, vol->agblocks, vol->inode_size);
+        rc = -EINVAL;
+        goto fail;
+    }
+
+    vol->dirblk_size = vol->block_size << sb[192];
+
+    debug("xfs block %u dirblock %u agcount %u v5 %d ftype %d\n", vol->block_size, vol->dirblk_size,
+          vol->agcount, vol->v5, vol->ftype);
+    return 0;
+
+fail:
+    xfs_unmount(vol);
+    return rc;
+}
+
+void xfs_unmount(xfs_vol *vol)
+{
+    if (vol->fd >= 0)
+    {
+        close(vol->fd);
+    }
+
+    memset(vol, 0, sizeof(xfs_vol));
+    vol->fd = -1;
+}
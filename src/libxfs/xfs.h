@@ -0,0 +1,68 @@
+/******************************************************************************
+ * xfs.h  ---- read only XFS parser used to get the file blocklist
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __XFS_H__
+#define __XFS_H__
+
+#include <stdint.h>
+#include <vtoyloc.h>
+
+#define XFS_DIFLAG_REALTIME     0x0001
+
+typedef struct xfs_vol
+{
+    int fd;
+    int v5;                 // version 5 (crc) on disk format
+    int ftype;              // directory entries have a file type byte
+    int nrext64;            // inodes use 64 bit extent counters
+    uint32_t block_size;
+    uint32_t dirblk_size;
+    uint32_t inode_size;
+    uint32_t agblocks;
+    uint32_t agcount;
+    uint8_t  agblklog;
+    uint8_t  inopblog;
+    uint8_t  blocklog;
+    uint64_t rootino;
+    uint32_t reads;         // count of disk reads, for debug
+}xfs_vol;
+
+static inline uint16_t xfs_be16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t xfs_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t xfs_be64(const uint8_t *p)
+{
+    return ((uint64_t)xfs_be32(p) << 32) | xfs_be32(p + 4);
+}
+
+int xfs_mount(xfs_vol *vol, const char *devpath);
+void xfs_unmount(xfs_vol *vol);
+int xfs_lookup(xfs_vol *vol, const char *path, uint64_t *ino);
+/* unwritten extents are returned as holes, free the list with vtoy_runlist_free() */
+int xfs_get_extents(xfs_vol *vol, uint64_t ino, vtoy_runlist *list);
+
+#endif
@@ -77,7 +77,7 @@ typedef struct ventoy_os_param
     uint8_t   vtoy_disk_guid[16];
     uint64_t  vtoy_disk_size;       // disk size in bytes
     uint16_t  vtoy_disk_part_id;    // begin with 1
-    uint16_t  vtoy_disk_part_type;  // 0:exfat   1:ntfs  other: reserved
+    uint16_t  vtoy_disk_part_type;  // 0:exfat 1:ntfs 2:ext2/3/4 3:xfs 5:fat other: reserved
     char      vtoy_img_path[384];   // It seems to be enough, utf-8 format
     uint64_t  vtoy_img_size;        // image file size in bytes
 
@@ -97,6 +97,39 @@ typedef struct ventoy_os_param
     uint8_t   reserved[27];
 }ventoy_os_param;
 
+/*
+ * vtoydump --format=bin output, one record per image:
+ * a vtoy_bin_header followed by region_count vtoy_bin_region.
+ * All fields are in host byte order and 8-byte aligned, so the output
+ * file can be mmapped and walked by header_size + region_count * region_size.
+ */
+#define VTOY_BIN_MAGIC      "VTLC"
+#define VTOY_BIN_VERSION    1
+
+typedef struct vtoy_bin_header
+{
+    char      magic[4];             // VTOY_BIN_MAGIC
+    uint32_t  version;              // VTOY_BIN_VERSION
+    uint32_t  header_size;          // sizeof(vtoy_bin_header)
+    uint32_t  region_size;          // sizeof(vtoy_bin_region)
+    uint64_t  disk_size;            // disk size in bytes
+    uint64_t  image_size;           // image file size in bytes
+    uint16_t  disk_part_id;
+    uint16_t  disk_part_type;       // 0:exfat 1:ntfs 2:ext2/3/4 3:xfs 5:fat other: reserved
+    uint32_t  disk_sector_size;     // unit of all the region fields
+    uint64_t  part_start;           // partition start sector
+    char      disk_name[64];        // without /dev/
+    char      image_path[384];
+    uint64_t  region_count;         // 0 if no location table was requested
+}vtoy_bin_header;
+
+typedef struct vtoy_bin_region
+{
+    uint64_t  start;                // start sector in the image (dm table start)
+    uint64_t  length;               // sector count
+    uint64_t  part_offset;          // start sector in the partition
+}vtoy_bin_region;
+
 typedef struct acpi_table_header
 {
   uint8_t signature[4];
@@ -113,8 +146,9 @@ typedef struct acpi_table_header
 #pragma pack()
 
 extern int verbose;
+extern FILE *debug_out;     // NULL for stdout
 extern ventoy_guid vtoy_guid;
-#define debug(fmt, ...) if(verbose) printf(fmt, ##__VA_ARGS__)
+#define debug(fmt, ...) if(verbose) fprintf(debug_out ? debug_out : stdout, fmt, ##__VA_ARGS__)
 
 #define check_opt(c) (argv[ch][0] == '-' && argv[ch][1] == (c))
 
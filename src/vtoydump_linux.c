@@ -18,23 +18,52 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // memmem
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <dirent.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/dm-ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <vtoydump.h>
+#include <vtoyhash.h>
+#include <vtoyloc.h>
+#include <fat_access.h>
+#include <fat_misc.h>
+#include <fat_string.h>
+#include <fat_table.h>
+#include <ntfs.h>
+#include <extfs.h>
+#include <xfs.h>
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
 #if defined(_dragon_fly) || defined(_free_BSD) || defined(_QNX)
 #define MMAP_FLAGS          MAP_SHARED
 #else
@@ -44,14 +73,145 @@
 #define SEARCH_MEM_START 0x80000
 #define SEARCH_MEM_LEN   0x20000
 
+#define VTOY_WAIT_MAX    (INT_MAX / 1000)  // --wait seconds, poll() takes an int of ms
+
 #define SYS_EFI  "/sys/firmware/efi"
 #define VENTOY_OS_EFIVAR   VENTOY_VAR_NAME"-77772020-2e77-6576-6e74-6f792e6e6574"
 #define VENTOY_SYS_ACPI    "/sys/firmware/acpi/tables/VTOY"
 
+#define VTOY_CACHE_FILE    "/run/vtoydump.cache"
+#define VTOY_CACHE_MAGIC   0x48435456
+#define VTOY_CACHE_VERSION 2     // 2: exfat locations are disk absolute
+
+/*
+ * Resolved disk and image location saved in /run, so that later calls
+ * in the same boot skip disk discovery and file system parsing.
+ * The location table (location_len bytes) follows this header.
+ */
+typedef struct vtoy_cache_data
+{
+    uint32_t  magic;
+    uint32_t  version;
+
+    /* cache key */
+    uint8_t   vtoy_disk_guid[16];
+    uint8_t   vtoy_disk_signature[4];
+    uint64_t  vtoy_img_size;
+    char      vtoy_img_path[384];
+    uint32_t  volume_serial;        // exfat volume serial, 0 for other fs
+    uint16_t  volume_state;         // exfat volume state (dirty flag)
+    uint16_t  reserved;
+
+    char      diskname[255];
+    uint64_t  part_start;
+    uint32_t  location_len;         // 0 means no location table cached
+}vtoy_cache_data;
+
+#define VTOY_PROBE_THREADS  8
+#define VTOY_PROBE_TIMEOUT  3   // seconds allowed for each device
+
+#define VTOY_PROBE_WAIT     0
+#define VTOY_PROBE_BUSY     1
+#define VTOY_PROBE_DONE     2
+#define VTOY_PROBE_FAIL     3
+#define VTOY_PROBE_TIMEDOUT 4
+
+typedef struct vtoy_disk_probe
+{
+    char name[256];
+    int state;
+    struct timespec start;
+    unsigned long long size;
+    uint8_t guid[16];
+    uint8_t sig[4];
+}vtoy_disk_probe;
+
+typedef struct vtoy_probe_ctx
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+    int next;
+    int finished;
+    vtoy_disk_probe *probes;
+}vtoy_probe_ctx;
+
+#define VTOY_OUT_TEXT       0
+#define VTOY_OUT_JSON       1
+#define VTOY_OUT_BIN        2
+
+/* all the output is built here and written to stdout at once */
+typedef struct vtoy_writer
+{
+    char   *buf;
+    size_t  len;
+    size_t  size;
+    int     items;      // members written in the top level json object
+    int     error;
+}vtoy_writer;
+
+#define VTOY_STREAM_BUFS        4
+#define VTOY_STREAM_CHUNK       (1024 * 1024)
+#define VTOY_STREAM_DIRECT_MAX  (64 * 1024 * 1024)
+
+typedef struct vtoy_extent
+{
+    uint64_t offset;    // disk offset in bytes
+    uint64_t length;
+}vtoy_extent;
+
+typedef struct vtoy_stream
+{
+    int diskfd;
+    int outfd;
+    vtoy_extent *extents;
+    int count;
+    int cur;            // current extent
+    uint64_t pos;       // position in the current extent
+
+    /* read ahead pipeline */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *bufs[VTOY_STREAM_BUFS];
+    size_t lens[VTOY_STREAM_BUFS];
+    int head;
+    int tail;
+    int filled;
+    int eof;
+    int error;
+}vtoy_stream;
+
+#define VTOY_VERIFY_THREADS     4
+#define VTOY_VERIFY_BUFS        8
+
+typedef struct vtoy_verify
+{
+    int diskfd;
+    vtoy_extent *chunks;
+    int count;
+    int next;                           // next chunk to read
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *bufs[VTOY_VERIFY_BUFS];
+    int seq[VTOY_VERIFY_BUFS];          // chunk held in the buffer, -1 if free
+    int ready[VTOY_VERIFY_BUFS];
+    int error;
+}vtoy_verify;
+
 ventoy_image_location * ventoy_get_location_by_lsexfat(const char *diskname, int part, const char *filename);
+int ventoy_get_locations_by_lsexfat(const char *diskname, int part, int count,
+                                    const char **filenames, ventoy_image_location **locations);
 
 static int format = 0;
+static int outfmt = VTOY_OUT_TEXT;
+static vtoy_writer g_out;
+static unsigned long long g_mem_start = SEARCH_MEM_START;
+static size_t g_mem_len = SEARCH_MEM_LEN;
+static int use_cache = 1;
+static vtoy_cache_data g_cache;
+static ventoy_image_location *g_cache_location = NULL;
 int verbose = 0;
+FILE *debug_out = NULL;
 ventoy_guid vtoy_guid = VENTOY_GUID;
 static const char *vtoy_fs_type[] = 
 {
@@ -152,12 +312,51 @@ int vtoy_os_param_from_efivar(ventoy_os_param *param)
     }
 }
 
+/*
+ * Find ventoy os param in a memory buffer.
+ * Search the GUID with memmem first and verify the checksum only at the 
+ * 16-byte aligned hits, instead of checking every 16-byte step.
+ */
+static const ventoy_os_param * vtoy_scan_os_param(const char *buf, size_t len)
+{
+    const char *pos = buf;
+    const char *end = NULL;
+
+    if (len < sizeof(ventoy_os_param))
+    {
+        return NULL;
+    }
+
+    /* the whole param must lie in the buffer */
+    end = buf + len - sizeof(ventoy_os_param) + sizeof(ventoy_guid);
+
+    while (pos < end)
+    {
+        pos = (const char *)memmem(pos, end - pos, &vtoy_guid, sizeof(ventoy_guid));
+        if (!pos)
+        {
+            break;
+        }
+
+        if (((pos - buf) & 15) == 0 && vtoy_check_os_param((ventoy_os_param *)pos) == 0)
+        {
+            return (const ventoy_os_param *)pos;
+        }
+        pos++;
+    }
+
+    return NULL;
+}
+
 int vtoy_os_param_from_phymem(ventoy_os_param *param)
 {
-    int i = 0;
     int fd = 0;
     int rc = 1;
     char *mapbuf = NULL;
+    unsigned long long mapstart;
+    size_t maplen;
+    size_t offset;
+    const ventoy_os_param *found = NULL;
 
     fd = open("/dev/mem", O_RDONLY | O_BINARY);
     if (fd < 0)
@@ -166,7 +365,12 @@ int vtoy_os_param_from_phymem(ventoy_os_param *param)
         return errno;
     }
 
-    mapbuf = (char *)mmap(NULL, SEARCH_MEM_LEN, PROT_READ, MMAP_FLAGS, fd, SEARCH_MEM_START);
+    /* mmap offset must be page aligned */
+    offset = (size_t)(g_mem_start % (unsigned long long)sysconf(_SC_PAGESIZE));
+    mapstart = g_mem_start - offset;
+    maplen = g_mem_len + offset;
+
+    mapbuf = (char *)mmap(NULL, maplen, PROT_READ, MMAP_FLAGS, fd, (off_t)mapstart);
     if (mapbuf == NULL || (uint32_t)(unsigned long)mapbuf == 0xFFFFFFFF)
     {
         fprintf(stderr, "mmap failed, NULL %d  %p\n", errno, mapbuf);
@@ -174,20 +378,18 @@ int vtoy_os_param_from_phymem(ventoy_os_param *param)
         return errno;
     }
 
-    debug("map memory 0x%x at %p\n", SEARCH_MEM_START, mapbuf);
+    debug("map memory 0x%llx length 0x%zx at %p\n", mapstart, maplen, mapbuf);
 
-    for (i = 0; i < SEARCH_MEM_LEN; i += 16)
+    found = vtoy_scan_os_param(mapbuf + offset, g_mem_len);
+    if (found)
     {
-        if (0 == vtoy_check_os_param((ventoy_os_param *)(mapbuf + i)))
-        {
-            debug("find ventoy os pararm at %p offset %d phymem:0x%08x\n", mapbuf + i, i, SEARCH_MEM_START + i);
-            memcpy(param, mapbuf + i, sizeof(ventoy_os_param));
-            rc = 0;
-            break;
-        }
+        debug("find ventoy os pararm at %p phymem:0x%08llx\n", found, 
+              mapstart + (unsigned long long)((const char *)found - mapbuf));
+        memcpy(param, found, sizeof(ventoy_os_param));
+        rc = 0;
     }
 
-    munmap(mapbuf, SEARCH_MEM_LEN);
+    munmap(mapbuf, maplen);
     close(fd);
 
     return rc;
@@ -197,6 +399,7 @@ static int vtoy_get_disk_guid(const char *diskname, uint8_t *vtguid, uint8_t *vt
 {
     int i = 0;
     int fd = 0;
+    uint8_t sector[512];
     char devdisk[256] = {0};
 
     snprintf(devdisk, sizeof(devdisk) - 1, "/dev/%s", diskname);
@@ -204,12 +407,18 @@ static int vtoy_get_disk_guid(const char *diskname, uint8_t *vtguid, uint8_t *vt
     fd = open(devdisk, O_RDONLY | O_BINARY);
     if (fd >= 0)
     {
-        lseek(fd, 0x180, SEEK_SET);
-        read(fd, vtguid, 16);
-        lseek(fd, 0x1b8, SEEK_SET);
-        read(fd, vtsig, 4);
+        /* GUID (0x180) and disk signature (0x1b8) are both in the first sector */
+        if (pread(fd, sector, sizeof(sector), 0) != sizeof(sector))
+        {
+            debug("failed to read %s %d\n", devdisk, errno);
+            close(fd);
+            return EIO;
+        }
         close(fd);
 
+        memcpy(vtguid, sector + 0x180, 16);
+        memcpy(vtsig, sector + 0x1b8, 4);
+
         debug("GUID for %s: <", devdisk);
         for (i = 0; i < 16; i++)
         {
@@ -299,115 +508,299 @@ static int vtoy_is_possible_blkdev(const char *name)
     return 1;
 }
 
-static int vtoy_find_disk_by_size(unsigned long long size, char *diskname, int buflen)
+static int vtoy_check_device(ventoy_os_param *param, const char *device)
 {
-    unsigned long long cursize = 0;
-    DIR* dir = NULL;
-    struct dirent* p = NULL;
-    int rc = 0;
+    uint8_t vtguid[16] = {0};
+    uint8_t vtsig[4] = {0};
 
-    dir = opendir("/sys/block");
-    if (!dir)
+    debug("vtoy_check_device for <%s>\n", device);
+
+    vtoy_get_disk_guid(device, vtguid, vtsig);
+
+    if (memcmp(vtguid, param->vtoy_disk_guid, 16) == 0 &&
+        memcmp(vtsig, param->vtoy_disk_signature, 4) == 0)
     {
+        debug("<%s> is right ventoy disk\n", device);
         return 0;
     }
-    
-    while ((p = readdir(dir)) != NULL)
+    else
     {
-        if (!vtoy_is_possible_blkdev(p->d_name))
+        debug("<%s> is NOT right ventoy disk\n", device);
+        return 1;
+    }
+}
+
+static void * vtoy_probe_thread(void *arg)
+{
+    int i;
+    int rc;
+    vtoy_probe_ctx *ctx = (vtoy_probe_ctx *)arg;
+    vtoy_disk_probe *probe = NULL;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->next >= ctx->count)
         {
-            debug("disk %s is filted by name\n", p->d_name);
-            continue;
+            pthread_mutex_unlock(&ctx->lock);
+            break;
         }
-    
-        cursize = vtoy_get_disk_size_in_byte(p->d_name);
-        debug("disk %s size %llu\n", p->d_name, (unsigned long long)cursize);
-        if (cursize == size)
+        i = ctx->next++;
+        probe = ctx->probes + i;
+        clock_gettime(CLOCK_MONOTONIC, &probe->start);
+        probe->state = VTOY_PROBE_BUSY;
+        pthread_mutex_unlock(&ctx->lock);
+
+        probe->size = vtoy_get_disk_size_in_byte(probe->name);
+        rc = vtoy_get_disk_guid(probe->name, probe->guid, probe->sig);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (probe->state == VTOY_PROBE_BUSY)
         {
-            snprintf(diskname, buflen, "%s", p->d_name);
-            rc++;
+            /* a timed out probe was already counted by vtoy_wait_probe */
+            probe->state = (rc == 0) ? VTOY_PROBE_DONE : VTOY_PROBE_FAIL;
+            ctx->finished++;
         }
+        pthread_cond_signal(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
     }
-    closedir(dir);
-    return rc;    
+
+    return NULL;
 }
 
-static int vtoy_find_disk_by_guid(ventoy_os_param *param, char *diskname, int buflen)
+static int vtoy_collect_blkdev(vtoy_probe_ctx *ctx)
 {
-    int rc = 0;
-    int count = 0;
+    int max = 0;
     DIR* dir = NULL;
     struct dirent* p = NULL;
-    uint8_t vtsig[4];
-    uint8_t vtguid[16];
+    vtoy_disk_probe *probes = NULL;
 
     dir = opendir("/sys/block");
     if (!dir)
     {
-        return 0;
+        return 1;
     }
     
     while ((p = readdir(dir)) != NULL)
     {
         if (!vtoy_is_possible_blkdev(p->d_name))
         {
-            debug("disk %s is filted by name\n", p->d_name);        
+            debug("disk %s is filted by name\n", p->d_name);
             continue;
         }
-    
-        memset(vtguid, 0, sizeof(vtguid));
-        rc = vtoy_get_disk_guid(p->d_name, vtguid, vtsig);
-        if (rc == 0 && memcmp(vtguid, param->vtoy_disk_guid, 16) == 0 &&
-            memcmp(vtsig, param->vtoy_disk_signature, 4) == 0)
+
+        if (ctx->count >= max)
         {
-            snprintf(diskname, buflen, "%s", p->d_name);
-            count++;
+            max = max ? max * 2 : 32;
+            probes = realloc(ctx->probes, max * sizeof(vtoy_disk_probe));
+            if (!probes)
+            {
+                break;
+            }
+            ctx->probes = probes;
         }
+
+        memset(ctx->probes + ctx->count, 0, sizeof(vtoy_disk_probe));
+        snprintf(ctx->probes[ctx->count].name, sizeof(ctx->probes[ctx->count].name), "%s", p->d_name);
+        ctx->count++;
     }
     closedir(dir);
     
-    return count;    
+    return 0;
 }
 
-static int vtoy_check_device(ventoy_os_param *param, const char *device)
+static int vtoy_timespec_cmp(struct timespec *a, struct timespec *b)
 {
-    uint8_t vtguid[16] = {0};
-    uint8_t vtsig[4] = {0};
-
-    debug("vtoy_check_device for <%s>\n", device);
-
-    vtoy_get_disk_guid(device, vtguid, vtsig);
-
-    if (memcmp(vtguid, param->vtoy_disk_guid, 16) == 0 &&
-        memcmp(vtsig, param->vtoy_disk_signature, 4) == 0)
+    if (a->tv_sec != b->tv_sec)
     {
-        debug("<%s> is right ventoy disk\n", device);
-        return 0;
+        return (a->tv_sec < b->tv_sec) ? -1 : 1;
     }
-    else
+    if (a->tv_nsec != b->tv_nsec)
     {
-        debug("<%s> is NOT right ventoy disk\n", device);
-        return 1;
+        return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Wait until all devices are probed. A device that does not answer within
+ * VTOY_PROBE_TIMEOUT seconds is skipped and its thread, blocked in the
+ * device, is replaced by a new one so the devices left keep being probed.
+ * Return 1 if some probe threads are still running (ctx can't be freed).
+ */
+static int vtoy_wait_probe(vtoy_probe_ctx *ctx)
+{
+    int i;
+    int stuck = 0;
+    pthread_t tid;
+    pthread_attr_t attr;
+    struct timespec now;
+    struct timespec expire;
+    struct timespec deadline;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->finished < ctx->count)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        deadline.tv_sec = now.tv_sec + VTOY_PROBE_TIMEOUT;
+        deadline.tv_nsec = now.tv_nsec;
+        for (i = 0; i < ctx->next; i++)
+        {
+            if (ctx->probes[i].state != VTOY_PROBE_BUSY)
+            {
+                continue;
+            }
+
+            expire = ctx->probes[i].start;
+            expire.tv_sec += VTOY_PROBE_TIMEOUT;
+            if (vtoy_timespec_cmp(&now, &expire) < 0)
+            {
+                if (vtoy_timespec_cmp(&expire, &deadline) < 0)
+                {
+                    deadline = expire;
+                }
+                continue;
+            }
+
+            debug("disk %s probe timeout\n", ctx->probes[i].name);
+            fprintf(stderr, "Disk %s did not respond in %d seconds, skipped\n", ctx->probes[i].name, VTOY_PROBE_TIMEOUT);
+            ctx->probes[i].state = VTOY_PROBE_TIMEDOUT;
+            ctx->finished++;
+            stuck++;
+
+            if (ctx->next < ctx->count && pthread_create(&tid, &attr, vtoy_probe_thread, ctx) != 0)
+            {
+                /* out of threads, give up the devices not probed yet */
+                for (; ctx->next < ctx->count; ctx->next++)
+                {
+                    debug("disk %s not probed\n", ctx->probes[ctx->next].name);
+                    ctx->probes[ctx->next].state = VTOY_PROBE_FAIL;
+                    ctx->finished++;
+                }
+            }
+        }
+
+        if (ctx->finished < ctx->count)
+        {
+            pthread_cond_timedwait(&ctx->cond, &ctx->lock, &deadline);
+        }
     }
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_attr_destroy(&attr);
+    return stuck ? 1 : 0;
 }
 
+/*
+ * Find the ventoy disk in one pass over /sys/block.
+ * The size, GUID and signature of each device are probed concurrently, 
+ * the GUID and signature must match, the size is used to distinguish 
+ * multiple matched disks.
+ */
 int vtoy_find_disk(ventoy_os_param *param, char *diskname, int buflen)
 {
+    int i;
     int cnt = 0;
+    int sizecnt = 0;
+    int nthread = 0;
+    int stuck = 0;
+    pthread_t tids[VTOY_PROBE_THREADS];
+    pthread_condattr_t attr;
+    vtoy_disk_probe *match = NULL;
+    vtoy_disk_probe *sizematch = NULL;
+    vtoy_probe_ctx *ctx = NULL;
+
+    ctx = (vtoy_probe_ctx *)calloc(1, sizeof(vtoy_probe_ctx));
+    if (!ctx || vtoy_collect_blkdev(ctx) != 0)
+    {
+        free(ctx);
+        fprintf(stderr, "No ventoy disk found\n");
+        return 1;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (i = 0; i < VTOY_PROBE_THREADS && i < ctx->count; i++)
+    {
+        if (pthread_create(tids + nthread, NULL, vtoy_probe_thread, ctx) == 0)
+        {
+            nthread++;
+        }
+    }
+
+    if (nthread == 0)
+    {
+        /* no thread available, probe in the current thread */
+        vtoy_probe_thread(ctx);
+    }
+    else
+    {
+        stuck = vtoy_wait_probe(ctx);
+    }
+
+    for (i = 0; i < ctx->count; i++)
+    {
+        vtoy_disk_probe *probe = ctx->probes + i;
+
+        if (probe->state != VTOY_PROBE_DONE)
+        {
+            continue;
+        }
+
+        debug("disk %s size %llu\n", probe->name, probe->size);
+        if (memcmp(probe->guid, param->vtoy_disk_guid, 16) == 0 &&
+            memcmp(probe->sig, param->vtoy_disk_signature, 4) == 0)
+        {
+            match = probe;
+            cnt++;
+            if (probe->size == param->vtoy_disk_size)
+            {
+                sizematch = probe;
+                sizecnt++;
+            }
+        }
+    }
+    debug("find disk by guid cnt=%d, by guid and size %llu cnt=%d...\n", cnt, 
+          (unsigned long long)param->vtoy_disk_size, sizecnt);
 
-    cnt = vtoy_find_disk_by_size(param->vtoy_disk_size, diskname, buflen);
-    debug("find disk by size %llu, cnt=%d...\n", (unsigned long long)param->vtoy_disk_size, cnt);
-    if (1 == cnt)
+    if (cnt > 1 && sizecnt == 1)
     {
-        if (vtoy_check_device(param, diskname) != 0)
+        match = sizematch;
+        cnt = 1;
+    }
+
+    if (cnt == 1)
+    {
+        debug("<%s> is right ventoy disk\n", match->name);
+        snprintf(diskname, buflen, "%s", match->name);
+    }
+
+    if (stuck)
+    {
+        /* some threads are blocked in a device, leave them and ctx alone */
+        for (i = 0; i < nthread; i++)
         {
-            cnt = 0;
+            pthread_detach(tids[i]);
         }
     }
     else
     {
-        cnt = vtoy_find_disk_by_guid(param, diskname, buflen);
-        debug("find disk by guid cnt=%d...\n", cnt);
+        for (i = 0; i < nthread; i++)
+        {
+            pthread_join(tids[i], NULL);
+        }
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx->probes);
+        free(ctx);
     }
     
     if (cnt > 1)
@@ -426,6 +819,149 @@ int vtoy_find_disk(ventoy_os_param *param, char *diskname, int buflen)
     }
 }
 
+static int vtoy_open_uevent(void)
+{
+    int fd;
+    struct sockaddr_nl addr;
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+    {
+        debug("failed to create uevent socket %d\n", errno);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;     // kernel uevents
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        debug("failed to bind uevent socket %d\n", errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Parse one uevent message "action@devpath\0KEY=value\0...".
+ * Return the device name if it's a whole disk just added (or its media changed).
+ */
+static const char * vtoy_uevent_disk(char *buf, int len)
+{
+    char *p = NULL;
+    const char *action = NULL;
+    const char *subsystem = NULL;
+    const char *devtype = NULL;
+    const char *devname = NULL;
+
+    buf[len] = 0;
+    for (p = buf; p < buf + len; p += strlen(p) + 1)
+    {
+        if (strncmp(p, "ACTION=", 7) == 0)
+        {
+            action = p + 7;
+        }
+        else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+        {
+            subsystem = p + 10;
+        }
+        else if (strncmp(p, "DEVTYPE=", 8) == 0)
+        {
+            devtype = p + 8;
+        }
+        else if (strncmp(p, "DEVNAME=", 8) == 0)
+        {
+            devname = p + 8;
+        }
+    }
+
+    if (!action || !subsystem || !devtype || !devname)
+    {
+        return NULL;
+    }
+
+    if (strcmp(subsystem, "block") || strcmp(devtype, "disk") || 
+        (strcmp(action, "add") && strcmp(action, "change")))
+    {
+        return NULL;
+    }
+
+    if (strncmp(devname, "/dev/", 5) == 0)
+    {
+        devname += 5;
+    }
+
+    debug("uevent %s disk %s\n", action, devname);
+    return devname;
+}
+
+/*
+ * Wait on the uevent socket until the ventoy disk is added.
+ * timeout is in seconds, negative means wait forever.
+ */
+static int vtoy_wait_disk(int fd, ventoy_os_param *param, int timeout, char *diskname, int buflen)
+{
+    int rc;
+    int len;
+    int waitms = -1;
+    const char *name = NULL;
+    char buf[8192 + 1];
+    struct pollfd pfd;
+    struct timespec now;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+
+    for (;;)
+    {
+        if (timeout >= 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            waitms = (int)((deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000);
+            if (waitms <= 0)
+            {
+                break;
+            }
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        rc = poll(&pfd, 1, waitms);
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (rc < 0)
+        {
+            debug("failed to poll uevent socket %d\n", errno);
+            return 1;
+        }
+        else if (rc == 0)
+        {
+            continue;
+        }
+
+        len = (int)recv(fd, buf, sizeof(buf) - 1, 0);
+        if (len <= 0)
+        {
+            continue;
+        }
+
+        name = vtoy_uevent_disk(buf, len);
+        if (name && vtoy_is_possible_blkdev(name) && vtoy_check_device(param, name) == 0)
+        {
+            snprintf(diskname, buflen, "%s", name);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Timeout waiting for ventoy disk\n");
+    return 1;
+}
+
 static ventoy_image_location * ventoy_get_location_by_phymem(ventoy_os_param *param)
 {
     int fd = 0;
@@ -512,120 +1048,2055 @@ static ventoy_image_location * ventoy_get_location_by_acpi(ventoy_os_param *para
     return location;
 }
 
-int vtoy_print_image_location(ventoy_os_param *param, char *diskname)
+static void vtoy_get_part_name(const char *diskname, int part, char *partname, int buflen)
 {
-    int i;
-    int fd = 0;
-    int partflag = 0;
-    unsigned long long start;
-    unsigned long long count;
-    unsigned long long partstart;
-    ventoy_image_location *location = NULL;
-    ventoy_image_disk_region *region = NULL;
-    char dmdisk[256] = {0};
-    char sysstart[256] = {0};
-    char valuebuf[64] = {0};
-
-    snprintf(dmdisk, sizeof(dmdisk) - 1, "/dev/%s", diskname);
-    
-    /*
-     * Ventoy save a copy of image disk location data to phy memory before load.
-     * But in some cases the phymem can not be read in userspace.
+    if (strstr(diskname, "nvme") || strstr(diskname, "mmc") || strstr(diskname, "nbd"))
+    {
+        snprintf(partname, buflen, "/dev/%sp%d", diskname, part);
+    }
+    else
+    {
+        snprintf(partname, buflen, "/dev/%s%d", diskname, part);
+    }
+}
+
+static int vtoy_out_reserve(size_t len)
+{
+    size_t size;
+    char *buf = NULL;
+
+    if (g_out.len + len <= g_out.size)
+    {
+        return 0;
+    }
+
+    size = g_out.size ? g_out.size : 65536;
+    while (size < g_out.len + len)
+    {
+        size *= 2;
+    }
+
+    buf = (char *)realloc(g_out.buf, size);
+    if (!buf)
+    {
+        g_out.error = 1;
+        return 1;
+    }
+
+    g_out.buf = buf;
+    g_out.size = size;
+    return 0;
+}
+
+static void vtoy_out_write(const void *data, size_t len)
+{
+    if (vtoy_out_reserve(len) == 0)
+    {
+        memcpy(g_out.buf + g_out.len, data, len);
+        g_out.len += len;
+    }
+}
+
+static void vtoy_out_printf(const char *fmt, ...)
+{
+    int len;
+    va_list ap;
+
+    va_start(ap, fmt);
+    len = vsnprintf(g_out.buf + g_out.len, g_out.size - g_out.len, fmt, ap);
+    va_end(ap);
+
+    if (len < 0)
+    {
+        g_out.error = 1;
+        return;
+    }
+
+    if (g_out.len + len >= g_out.size)
+    {
+        if (vtoy_out_reserve(len + 1))
+        {
+            return;
+        }
+
+        va_start(ap, fmt);
+        vsnprintf(g_out.buf + g_out.len, g_out.size - g_out.len, fmt, ap);
+        va_end(ap);
+    }
+
+    g_out.len += len;
+}
+
+static void vtoy_out_json_str(const char *str)
+{
+    const unsigned char *c = NULL;
+
+    vtoy_out_write("\"", 1);
+    for (c = (const unsigned char *)str; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            vtoy_out_printf("\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            vtoy_out_printf("\\u%04x", *c);
+        }
+        else
+        {
+            vtoy_out_write(c, 1);
+        }
+    }
+    vtoy_out_write("\"", 1);
+}
+
+/* start a member of the top level json object */
+static void vtoy_out_json_key(const char *key)
+{
+    if (g_out.items++)
+    {
+        vtoy_out_write(",", 1);
+    }
+    vtoy_out_printf("\"%s\":", key);
+}
+
+static void vtoy_out_begin(void)
+{
+    if (outfmt == VTOY_OUT_JSON)
+    {
+        vtoy_out_write("{", 1);
+    }
+}
+
+static int vtoy_out_end(void)
+{
+    if (outfmt == VTOY_OUT_JSON)
+    {
+        vtoy_out_write("}\n", 2);
+    }
+
+    if (g_out.error || fwrite(g_out.buf, 1, g_out.len, stdout) != g_out.len || fflush(stdout))
+    {
+        fprintf(stderr, "Failed to write output\n");
+        return 1;
+    }
+
+    g_out.len = 0;
+    return 0;
+}
+
+static void vtoy_out_bin_record(ventoy_os_param *param, char *diskname, const char *imgpath, uint64_t imgsize,
+                                ventoy_image_location *location, unsigned long long partstart)
+{
+    uint32_t i;
+    vtoy_bin_header header;
+    vtoy_bin_region *region = NULL;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VTOY_BIN_MAGIC, sizeof(header.magic));
+    header.version = VTOY_BIN_VERSION;
+    header.header_size = sizeof(vtoy_bin_header);
+    header.region_size = sizeof(vtoy_bin_region);
+    header.disk_size = param->vtoy_disk_size;
+    header.image_size = imgsize;
+    header.disk_part_id = param->vtoy_disk_part_id;
+    header.disk_part_type = param->vtoy_disk_part_type;
+    header.disk_sector_size = location ? location->disk_sector_size : 512;
+    header.part_start = partstart;
+    snprintf(header.disk_name, sizeof(header.disk_name), "%s", diskname);
+    snprintf(header.image_path, sizeof(header.image_path), "%s", imgpath);
+    header.region_count = location ? location->region_count : 0;
+
+    if (vtoy_out_reserve(sizeof(header) + header.region_count * sizeof(vtoy_bin_region)))
+    {
+        return;
+    }
+
+    vtoy_out_write(&header, sizeof(header));
+    for (i = 0; i < header.region_count; i++)
+    {
+        region = (vtoy_bin_region *)(g_out.buf + g_out.len);
+        region->start = (uint64_t)location->regions[i].image_start_sector * location->image_sector_size / location->disk_sector_size;
+        region->length = (uint64_t)location->regions[i].image_sector_count * location->image_sector_size / location->disk_sector_size;
+        region->part_offset = location->regions[i].disk_start_sector - partstart;
+        g_out.len += sizeof(vtoy_bin_region);
+    }
+}
+
+static unsigned long long vtoy_get_part_start(ventoy_os_param *param, const char *diskname)
+{
+    int fd = 0;
+    unsigned long long partstart;
+    char sysstart[256] = {0};
+    char valuebuf[64] = {0};
+
+    if (strstr(diskname, "nvme") || strstr(diskname, "mmc") || strstr(diskname, "nbd"))
+    {
+        snprintf(sysstart, sizeof(sysstart) - 1, "/sys/class/block/%sp%u/start", diskname, param->vtoy_disk_part_id);
+    }
+    else
+    {
+        snprintf(sysstart, sizeof(sysstart) - 1, "/sys/class/block/%s%u/start", diskname, param->vtoy_disk_part_id);
+    }
+
+    partstart = 2048;
+    if (access(sysstart, F_OK) >= 0)
+    {
+        debug("get part start from sysfs for %s\n", sysstart);
+        
+        fd = open(sysstart, O_RDONLY | O_BINARY);
+        if (fd >= 0)
+        {
+            read(fd, valuebuf, sizeof(valuebuf));
+            partstart = strtoull(valuebuf, NULL, 10);
+            close(fd);
+        }
+    }
+    else
+    {
+        debug("%s not exist \n", sysstart);
+    }
+
+    return partstart;
+}
+
+static void vtoy_print_location_table(ventoy_os_param *param, char *diskname, 
+                                      ventoy_image_location *location, unsigned long long partstart)
+{
+    int i;
+    unsigned long long start;
+    unsigned long long count;
+    ventoy_image_disk_region *region = NULL;
+    char partname[256] = {0};
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+
+    if (outfmt == VTOY_OUT_JSON)
+    {
+        vtoy_out_printf("{\"disk_sector_size\":%u,\"image_sector_size\":%u,\"part_start\":%llu,\"device\":",
+                        location->disk_sector_size, location->image_sector_size, partstart);
+        vtoy_out_json_str(partname);
+        vtoy_out_printf(",\"region_count\":%u,\"regions\":[", location->region_count);
+    }
+
+    /* print location in dmsetup table format */
+    for (i = 0; i < (int)location->region_count; i++)
+    {
+        region = location->regions + i;
+        start = (unsigned long long)region->image_start_sector * location->image_sector_size / location->disk_sector_size;
+        count = (unsigned long long)region->image_sector_count * location->image_sector_size / location->disk_sector_size;
+
+        if (outfmt == VTOY_OUT_JSON)
+        {
+            vtoy_out_printf("%s{\"start\":%llu,\"length\":%llu,\"offset\":%llu}", i ? "," : "", start, count,
+                            (unsigned long long)region->disk_start_sector - partstart);
+        }
+        else
+        {
+            vtoy_out_printf("%llu %llu linear %s %llu\n", start, count, partname,
+                            (unsigned long long)region->disk_start_sector - partstart);
+        }
+    }
+
+    if (outfmt == VTOY_OUT_JSON)
+    {
+        vtoy_out_printf("]}");
+    }
+}
+
+/*
+ * Read exfat volume serial and volume state (contains the dirty flag) 
+ * from the boot sector. They are part of the cache key, so any change to
+ * the file system made after the cache was saved invalidates it.
+ */
+static int vtoy_get_volume_state(ventoy_os_param *param, const char *diskname, uint32_t *serial, uint16_t *state)
+{
+    int fd;
+    uint8_t sector[512];
+    char partname[256] = {0};
+
+    *serial = 0;
+    *state = 0;
+
+    if (param->vtoy_disk_part_type != 0)
+    {
+        return 0;
+    }
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+    fd = open(partname, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        debug("failed to open %s %d\n", partname, errno);
+        return 1;
+    }
+
+    if (pread(fd, sector, sizeof(sector), 0) != sizeof(sector) || memcmp(sector + 3, "EXFAT   ", 8))
+    {
+        debug("no exfat boot sector in %s\n", partname);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+
+    memcpy(serial, sector + 0x64, sizeof(uint32_t));
+    memcpy(state, sector + 0x6A, sizeof(uint16_t));
+    return 0;
+}
+
+static int vtoy_fill_cache_key(ventoy_os_param *param, const char *diskname, vtoy_cache_data *data)
+{
+    memset(data, 0, sizeof(vtoy_cache_data));
+    data->magic = VTOY_CACHE_MAGIC;
+    data->version = VTOY_CACHE_VERSION;
+    memcpy(data->vtoy_disk_guid, param->vtoy_disk_guid, sizeof(data->vtoy_disk_guid));
+    memcpy(data->vtoy_disk_signature, param->vtoy_disk_signature, sizeof(data->vtoy_disk_signature));
+    data->vtoy_img_size = param->vtoy_img_size;
+    memcpy(data->vtoy_img_path, param->vtoy_img_path, sizeof(data->vtoy_img_path));
+
+    return vtoy_get_volume_state(param, diskname, &data->volume_serial, &data->volume_state);
+}
+
+/*
+ * Load the cache saved by a former call. The cached disk is validated by 
+ * its GUID and signature, so /sys/block is not scanned again.
+ */
+static int vtoy_load_cache(ventoy_os_param *param, char *diskname, int buflen)
+{
+    int fd;
+    vtoy_cache_data key;
+    vtoy_cache_data data;
+    ventoy_image_location *location = NULL;
+
+    fd = open(VTOY_CACHE_FILE, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        debug("no cache %s %d\n", VTOY_CACHE_FILE, errno);
+        return 1;
+    }
+
+    if (read(fd, &data, sizeof(data)) != sizeof(data) || 
+        data.magic != VTOY_CACHE_MAGIC || data.version != VTOY_CACHE_VERSION)
+    {
+        debug("invalid cache %s\n", VTOY_CACHE_FILE);
+        close(fd);
+        return 1;
+    }
+
+    data.diskname[sizeof(data.diskname) - 1] = 0;
+    if (vtoy_check_device(param, data.diskname) != 0 || vtoy_fill_cache_key(param, data.diskname, &key) != 0 ||
+        memcmp(&key, &data, offsetof(vtoy_cache_data, diskname)) != 0)
+    {
+        debug("cache %s is out of date\n", VTOY_CACHE_FILE);
+        close(fd);
+        return 1;
+    }
+
+    if (data.location_len > 0)
+    {
+        location = (ventoy_image_location *)malloc(data.location_len);
+        if (!location || read(fd, location, data.location_len) != (ssize_t)data.location_len ||
+            data.location_len < sizeof(ventoy_image_location) || vtoy_location_len(location) != data.location_len)
+        {
+            debug("invalid location in cache %s\n", VTOY_CACHE_FILE);
+            free(location);
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    debug("use cache %s for disk %s\n", VTOY_CACHE_FILE, data.diskname);
+    snprintf(diskname, buflen, "%s", data.diskname);
+    memcpy(&g_cache, &data, sizeof(data));
+    g_cache_location = location;
+    return 0;
+}
+
+static void vtoy_save_cache(ventoy_os_param *param, const char *diskname, 
+                            unsigned long long partstart, ventoy_image_location *location)
+{
+    int fd;
+    int rc = 0;
+    vtoy_cache_data data;
+    const char *tmpfile = VTOY_CACHE_FILE".tmp";
+
+    if (!use_cache || vtoy_fill_cache_key(param, diskname, &data) != 0)
+    {
+        return;
+    }
+
+    snprintf(data.diskname, sizeof(data.diskname), "%s", diskname);
+    data.part_start = partstart;
+    data.location_len = location ? vtoy_location_len(location) : 0;
+
+    fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd < 0)
+    {
+        debug("failed to create %s %d\n", tmpfile, errno);
+        return;
+    }
+
+    if (write(fd, &data, sizeof(data)) != sizeof(data) ||
+        (location && write(fd, location, data.location_len) != (ssize_t)data.location_len))
+    {
+        rc = 1;
+    }
+    close(fd);
+
+    /* replace the old cache atomically */
+    if (rc || rename(tmpfile, VTOY_CACHE_FILE) < 0)
+    {
+        debug("failed to save cache %s %d\n", VTOY_CACHE_FILE, errno);
+        unlink(tmpfile);
+    }
+}
+
+static int g_fat_fd = -1;
+
+static int vtoy_fat_disk_read(uint32 sector, uint8 *buffer, uint32 count)
+{
+    ssize_t len;
+
+    len = pread(g_fat_fd, buffer, (size_t)count * FAT_SECTOR_SIZE, (off_t)sector * FAT_SECTOR_SIZE);
+    if (len != (ssize_t)count * FAT_SECTOR_SIZE)
+    {
+        debug("failed to read fat sector %u count %u %d\n", sector, count, errno);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* find the start cluster and length of a file with the fat_access layer of fat_io_lib */
+static int vtoy_fat_lookup(struct fatfs *fs, char *path, uint32 *startcluster, uint64_t *length)
+{
+    int level;
+    int levels;
+    uint32 cluster;
+    char name[FATFS_MAX_LONG_FILENAME];
+    struct fat_dir_entry entry;
+
+    cluster = fatfs_get_root_cluster(fs);
+    levels = fatfs_total_path_levels(path);
+    if (levels < 0)
+    {
+        return 1;
+    }
+
+    /* the folders first, then the file itself at the last level */
+    for (level = 0; level <= levels; level++)
+    {
+        if (fatfs_get_substring(path, level, name, sizeof(name)) == -1 ||
+            !fatfs_get_file_entry(fs, cluster, name, &entry))
+        {
+            return 1;
+        }
+
+        if (level < levels ? !fatfs_entry_is_dir(&entry) : !fatfs_entry_is_file(&entry))
+        {
+            return 1;
+        }
+
+        cluster = ((FAT_HTONS((uint32)entry.FstClusHI)) << 16) + FAT_HTONS(entry.FstClusLO);
+    }
+
+    *startcluster = cluster;
+    *length = FAT_HTONL(entry.FileSize);
+    return 0;
+}
+
+/*
+ * Walk the cluster chain of the image with fat_io_lib and merge contiguous
+ * clusters into regions. Disk sectors are relative to the partition.
+ */
+static ventoy_image_location * ventoy_get_location_by_fatfs(ventoy_os_param *param, char *diskname)
+{
+    int rc = 1;
+    uint32 cluster;
+    uint32 next = FAT32_LAST_CLUSTER;
+    uint32 start;
+    uint32 count;
+    uint32_t maxregion = 256;
+    uint64_t left;
+    uint64_t size;
+    uint64_t clustersize;
+    uint64_t filelength = 0;
+    static struct fatfs fs;
+    ventoy_image_location *location = NULL;
+    char partname[256] = {0};
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+    g_fat_fd = open(partname, O_RDONLY | O_BINARY);
+    if (g_fat_fd < 0)
+    {
+        debug("failed to open %s %d\n", partname, errno);
+        return NULL;
+    }
+
+    /* the fat buffers make the struct large, so it is static */
+    memset(&fs, 0, sizeof(fs));
+    fs.disk_io.read_media = vtoy_fat_disk_read;
+    if (fatfs_init(&fs) != FAT_INIT_OK)
+    {
+        fprintf(stderr, "Failed to mount fat fs %s\n", partname);
+        goto end;
+    }
+
+    if (vtoy_fat_lookup(&fs, param->vtoy_img_path, &start, &filelength))
+    {
+        fprintf(stderr, "Failed to find %s in fat fs\n", param->vtoy_img_path);
+        goto end;
+    }
+
+    location = vtoy_alloc_location(maxregion);
+    if (!location)
+    {
+        goto end;
+    }
+
+    clustersize = (uint64_t)fs.sectors_per_cluster * FAT_SECTOR_SIZE;
+    if (clustersize % 2048)
+    {
+        /* regions are counted in 2048 byte sectors */
+        fprintf(stderr, "Unsupported fat cluster size %llu\n", (unsigned long long)clustersize);
+        goto end;
+    }
+
+    cluster = start;
+    for (left = filelength; left > 0; left -= size)
+    {
+        if (cluster < 2 || cluster == FAT32_LAST_CLUSTER)
+        {
+            fprintf(stderr, "Cluster chain of %s is shorter than the file\n", param->vtoy_img_path);
+            goto end;
+        }
+
+        /* count contiguous clusters */
+        start = cluster;
+        for (count = 1; (uint64_t)count * clustersize < left; count++)
+        {
+            next = fatfs_find_next_cluster(&fs, cluster);
+            if (next != cluster + 1)
+            {
+                break;
+            }
+            cluster = next;
+        }
+
+        size = MIN((uint64_t)count * clustersize, left);
+        if (vtoy_add_region(&location, &maxregion, size, (uint64_t)fatfs_lba_of_cluster(&fs, start) * FAT_SECTOR_SIZE))
+        {
+            goto end;
+        }
+
+        cluster = (size < left) ? next : FAT32_LAST_CLUSTER;
+    }
+
+    rc = 0;
+
+end:
+    close(g_fat_fd);
+    g_fat_fd = -1;
+
+    if (rc)
+    {
+        free(location);
+        return NULL;
+    }
+    return location;
+}
+
+/*
+ * Resolve the image with the read only ntfs parser and merge the $DATA runs
+ * into regions. Disk sectors are relative to the partition.
+ */
+static ventoy_image_location * ventoy_get_location_by_ntfs(ventoy_os_param *param, char *diskname)
+{
+    int rc;
+    uint64_t mftno = 0;
+    ntfs_vol vol;
+    vtoy_runlist rl;
+    ventoy_image_location *location = NULL;
+    char partname[256] = {0};
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+    rc = ntfs_mount(&vol, partname);
+    if (rc)
+    {
+        fprintf(stderr, "Failed to mount ntfs fs %s %d\n", partname, rc);
+        return NULL;
+    }
+
+    memset(&rl, 0, sizeof(rl));
+    rc = ntfs_lookup(&vol, param->vtoy_img_path, &mftno);
+    if (rc == 0)
+    {
+        rc = ntfs_get_runs(&vol, mftno, NTFS_AT_DATA, NULL, 0, &rl);
+    }
+
+    if (rc)
+    {
+        fprintf(stderr, "Failed to find %s in ntfs fs %d\n", param->vtoy_img_path, rc);
+        goto end;
+    }
+
+    if (rl.resident || (rl.flags & (NTFS_ATTR_COMPRESSED | NTFS_ATTR_ENCRYPTED | NTFS_ATTR_SPARSE)))
+    {
+        fprintf(stderr, "%s is resident, compressed, encrypted or sparse\n", param->vtoy_img_path);
+        goto end;
+    }
+
+    location = vtoy_runs_to_location(param->vtoy_img_path, &rl, vol.cluster_size);
+    debug("ntfs resolved %s with %u reads\n", param->vtoy_img_path, vol.reads);
+
+end:
+    vtoy_runlist_free(&rl);
+    ntfs_unmount(&vol);
+    return location;
+}
+
+/*
+ * Resolve the image with the read only ext2/3/4 parser and merge the extents
+ * into regions. Disk sectors are relative to the partition.
+ */
+static ventoy_image_location * ventoy_get_location_by_extfs(ventoy_os_param *param, char *diskname)
+{
+    int rc;
+    uint32_t ino = 0;
+    extfs_vol vol;
+    vtoy_runlist list;
+    ventoy_image_location *location = NULL;
+    char partname[256] = {0};
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+    rc = extfs_mount(&vol, partname);
+    if (rc)
+    {
+        fprintf(stderr, "Failed to mount ext fs %s %d\n", partname, rc);
+        return NULL;
+    }
+
+    memset(&list, 0, sizeof(list));
+    rc = extfs_lookup(&vol, param->vtoy_img_path, &ino);
+    if (rc == 0)
+    {
+        rc = extfs_get_extents(&vol, ino, &list);
+    }
+
+    if (rc)
+    {
+        fprintf(stderr, "Failed to find %s in ext fs %d\n", param->vtoy_img_path, rc);
+        goto end;
+    }
+
+    if (list.flags & EXTFS_ENCRYPT_FL)
+    {
+        fprintf(stderr, "%s is encrypted\n", param->vtoy_img_path);
+        goto end;
+    }
+
+    location = vtoy_runs_to_location(param->vtoy_img_path, &list, vol.block_size);
+    debug("ext fs resolved %s with %u reads\n", param->vtoy_img_path, vol.reads);
+
+end:
+    vtoy_runlist_free(&list);
+    extfs_unmount(&vol);
+    return location;
+}
+
+/*
+ * Resolve the image with the read only XFS parser and merge the data fork
+ * extents into regions. Disk sectors are relative to the partition.
+ */
+static ventoy_image_location * ventoy_get_location_by_xfs(ventoy_os_param *param, char *diskname)
+{
+    int rc;
+    uint64_t ino = 0;
+    xfs_vol vol;
+    vtoy_runlist list;
+    ventoy_image_location *location = NULL;
+    char partname[256] = {0};
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+    rc = xfs_mount(&vol, partname);
+    if (rc)
+    {
+        fprintf(stderr, "Failed to mount xfs %s %d\n", partname, rc);
+        return NULL;
+    }
+
+    memset(&list, 0, sizeof(list));
+    rc = xfs_lookup(&vol, param->vtoy_img_path, &ino);
+    if (rc == 0)
+    {
+        rc = xfs_get_extents(&vol, ino, &list);
+    }
+
+    if (rc)
+    {
+        fprintf(stderr, "Failed to find %s in xfs %d\n", param->vtoy_img_path, rc);
+        goto end;
+    }
+
+    if (list.flags & XFS_DIFLAG_REALTIME)
+    {
+        /* blocks of realtime files live on another device */
+        fprintf(stderr, "%s is a realtime file\n", param->vtoy_img_path);
+        goto end;
+    }
+
+    location = vtoy_runs_to_location(param->vtoy_img_path, &list, vol.block_size);
+    debug("xfs resolved %s with %u reads\n", param->vtoy_img_path, vol.reads);
+
+end:
+    vtoy_runlist_free(&list);
+    xfs_unmount(&vol);
+    return location;
+}
+
+#define VTOY_FIEMAP_EXTENTS 512
+
+/* extents whose data is not stored as is at fe_physical */
+#define VTOY_FIEMAP_BAD_FLAGS (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | \
+                               FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | \
+                               FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN)
+
+/* mountinfo escapes space, tab, newline and backslash as \ooo */
+static void vtoy_unescape_mount(char *path)
+{
+    char *src = path;
+    char *dst = path;
+
+    while (*src)
+    {
+        if (src[0] == '\\' && src[1] >= '0' && src[1] <= '3' &&
+            src[2] >= '0' && src[2] <= '7' && src[3] >= '0' && src[3] <= '7')
+        {
+            *dst++ = (char)(((src[1] - '0') << 6) | ((src[2] - '0') << 3) | (src[3] - '0'));
+            src += 4;
+        }
+        else
+        {
+            *dst++ = *src++;
+        }
+    }
+    *dst = 0;
+}
+
+/*
+ * Find a mount of device dev in /proc/self/mountinfo that can reach imgpath,
+ * and build the path of the image under it.
+ */
+static int vtoy_find_mount_path(dev_t dev, const char *imgpath, char *fullpath, int buflen)
+{
+    int rc = 1;
+    size_t len;
+    unsigned int devmajor, devminor;
+    FILE *fp = NULL;
+    char line[2048];
+    char root[1024];
+    char mntpoint[1024];
+
+    fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp)
+    {
+        debug("failed to open mountinfo %d\n", errno);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (sscanf(line, "%*d %*d %u:%u %1023s %1023s", &devmajor, &devminor, root, mntpoint) != 4)
+        {
+            continue;
+        }
+
+        if (makedev(devmajor, devminor) != dev)
+        {
+            continue;
+        }
+
+        vtoy_unescape_mount(root);
+        vtoy_unescape_mount(mntpoint);
+
+        /* bind mount of a sub directory, the image must be under it */
+        len = strlen(root);
+        if (strcmp(root, "/") == 0)
+        {
+            len = 0;
+        }
+        else if (strncmp(imgpath, root, len) || imgpath[len] != '/')
+        {
+            continue;
+        }
+
+        snprintf(fullpath, buflen, "%s%s", strcmp(mntpoint, "/") ? mntpoint : "", imgpath + len);
+        debug("image is accessible at %s\n", fullpath);
+        rc = 0;
+        break;
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Get the physical extents of an image file with FS_IOC_FIEMAP.
+ * Disk sectors are relative to the device the file system is on.
+ */
+static ventoy_image_location * vtoy_fiemap_location(const char *path, uint64_t imgsize)
+{
+    int fd;
+    int rc = 1;
+    int last = 0;
+    uint32_t i;
+    uint32_t maxregion = 256;
+    uint64_t size;
+    uint64_t logical = 0;
+    struct stat st;
+    struct fiemap *fm = NULL;
+    struct fiemap_extent *ext = NULL;
+    ventoy_image_location *location = NULL;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+    {
+        debug("failed to open %s %d\n", path, errno);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != imgsize)
+    {
+        debug("%s size mismatch %llu %llu\n", path, (unsigned long long)st.st_size, (unsigned long long)imgsize);
+        goto end;
+    }
+
+    fm = (struct fiemap *)malloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * VTOY_FIEMAP_EXTENTS);
+    location = vtoy_alloc_location(maxregion);
+    if (!fm || !location)
+    {
+        goto end;
+    }
+
+    while (!last && logical < imgsize)
+    {
+        memset(fm, 0, sizeof(struct fiemap));
+        fm->fm_start = logical;
+        fm->fm_length = FIEMAP_MAX_OFFSET - logical;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = VTOY_FIEMAP_EXTENTS;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+        {
+            debug("FS_IOC_FIEMAP failed %d\n", errno);
+            goto end;
+        }
+
+        if (fm->fm_mapped_extents == 0)
+        {
+            break;
+        }
+
+        for (i = 0; i < fm->fm_mapped_extents && logical < imgsize; i++)
+        {
+            ext = fm->fm_extents + i;
+            if (ext->fe_flags & VTOY_FIEMAP_BAD_FLAGS)
+            {
+                debug("unsupported extent flags 0x%x\n", ext->fe_flags);
+                goto end;
+            }
+
+            if (ext->fe_logical != logical)
+            {
+                debug("hole at %llu in %s\n", (unsigned long long)logical, path);
+                goto end;
+            }
+
+            size = MIN(ext->fe_length, imgsize - logical);
+            if (((size % 2048) && size < imgsize - logical) || (ext->fe_physical % 512))
+            {
+                /* regions are counted in 2048 byte sectors starting at a 512 byte sector */
+                debug("extent at %llu of %s is not aligned %llu %llu\n", (unsigned long long)logical, path,
+                      (unsigned long long)ext->fe_physical, (unsigned long long)ext->fe_length);
+                goto end;
+            }
+
+            if (vtoy_add_region(&location, &maxregion, size, ext->fe_physical))
+            {
+                goto end;
+            }
+
+            logical += ext->fe_length;
+            last = (ext->fe_flags & FIEMAP_EXTENT_LAST) ? 1 : 0;
+        }
+    }
+
+    if (logical < imgsize)
+    {
+        debug("extents of %s cover only %llu bytes\n", path, (unsigned long long)logical);
+        goto end;
+    }
+
+    rc = 0;
+
+end:
+    close(fd);
+    free(fm);
+
+    if (rc)
+    {
+        free(location);
+        return NULL;
+    }
+    return location;
+}
+
+/*
+ * If the ventoy partition is already mounted, let the kernel file system
+ * driver give us the image extents. This works for all the fs types.
+ */
+static ventoy_image_location * ventoy_get_location_by_fiemap(ventoy_os_param *param, char *diskname)
+{
+    struct stat st;
+    char partname[256] = {0};
+    char fullpath[2048] = {0};
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+    if (stat(partname, &st) < 0 || !S_ISBLK(st.st_mode))
+    {
+        debug("failed to stat %s %d\n", partname, errno);
+        return NULL;
+    }
+
+    if (vtoy_find_mount_path(st.st_rdev, param->vtoy_img_path, fullpath, sizeof(fullpath)))
+    {
+        debug("%s is not mounted\n", partname);
+        return NULL;
+    }
+
+    return vtoy_fiemap_location(fullpath, param->vtoy_img_size);
+}
+
+/*
+ * Locations from FIEMAP and the fs parsers (lsexfat included) are relative
+ * to the partition, while the table printed and cached is relative to the
+ * disk like the one from phymem or acpi, which vtoy_print_location_table()
+ * expects.
+ */
+static void vtoy_location_to_disk(ventoy_image_location *location, unsigned long long partstart)
+{
+    uint32_t i;
+
+    for (i = 0; i < location->region_count; i++)
+    {
+        location->regions[i].disk_start_sector += partstart;
+    }
+}
+
+/*
+ * Get the image location table (from cache, phymem, acpi or the fs), 
+ * the caller must free it.
+ */
+static ventoy_image_location * vtoy_get_image_location(ventoy_os_param *param, char *diskname, 
+                                                       unsigned long long *partstart)
+{
+    int cached = 0;
+    ventoy_image_location *location = NULL;
+
+    if (g_cache_location)
+    {
+        debug("get image location by cache\n");
+        location = g_cache_location;
+        g_cache_location = NULL;
+        *partstart = g_cache.part_start;
+        cached = 1;
+        goto check;
+    }
+    
+    /*
+     * Ventoy save a copy of image disk location data to phy memory before load.
+     * But in some cases the phymem can not be read in userspace.
      * For example CONFIG_DEVKMEM disabled, or CONFIG_STRICT_DEVMEM enabled.
-     * In that case, we directly parse the file system and get the image location.
+     * In that case, we ask the kernel fs driver (FIEMAP) if the partition is mounted,
+     * or directly parse the file system and get the image location.
      *
      */
     
     location = ventoy_get_location_by_phymem(param);
     if (!location)
     {
-        location = ventoy_get_location_by_acpi(param);
+        location = ventoy_get_location_by_acpi(param);
+    }
+
+    *partstart = vtoy_get_part_start(param, diskname);
+
+    if (!location)
+    {
+        debug("get image location by fiemap\n");
+        location = ventoy_get_location_by_fiemap(param, diskname);
+        if (location)
+        {
+            vtoy_location_to_disk(location, *partstart);
+        }
+    }
+
+    if (!location)
+    {
+        if (param->vtoy_disk_part_type == 0)
+        {
+            debug("get image location by fs tool\n");
+            location = ventoy_get_location_by_lsexfat(diskname, param->vtoy_disk_part_id, param->vtoy_img_path);
+        }
+        else if (param->vtoy_disk_part_type == 1)
+        {
+            debug("get image location by ntfs parser\n");
+            location = ventoy_get_location_by_ntfs(param, diskname);
+        }
+        else if (param->vtoy_disk_part_type == 2)
+        {
+            debug("get image location by ext parser\n");
+            location = ventoy_get_location_by_extfs(param, diskname);
+        }
+        else if (param->vtoy_disk_part_type == 3)
+        {
+            debug("get image location by xfs parser\n");
+            location = ventoy_get_location_by_xfs(param, diskname);
+        }
+        else if (param->vtoy_disk_part_type == 5)
+        {
+            debug("get image location by fat_io_lib\n");
+            location = ventoy_get_location_by_fatfs(param, diskname);
+        }
+
+        if (location)
+        {
+            vtoy_location_to_disk(location, *partstart);
+        }
+    }
+
+    if (!location)
+    {
+        fprintf(stderr, "Failed to find image location\n");
+        return NULL;
+    }
+
+check:
+    if (memcmp(&vtoy_guid, &location->guid, sizeof(ventoy_guid)))
+    {
+        free(location);
+        fprintf(stderr, "Image location data corrupted\n");
+        return NULL;
+    }
+
+    if (!cached)
+    {
+        vtoy_save_cache(param, diskname, *partstart, location);
+    }
+
+    return location;
+}
+
+int vtoy_print_image_location(ventoy_os_param *param, char *diskname)
+{
+    unsigned long long partstart = 0;
+    ventoy_image_location *location = NULL;
+
+    location = vtoy_get_image_location(param, diskname, &partstart);
+    if (!location)
+    {
+        return 1;
+    }
+
+    if (outfmt == VTOY_OUT_BIN)
+    {
+        vtoy_out_bin_record(param, diskname, param->vtoy_img_path, param->vtoy_img_size, location, partstart);
+    }
+    else if (outfmt == VTOY_OUT_JSON)
+    {
+        vtoy_out_json_key("location");
+        vtoy_print_location_table(param, diskname, location, partstart);
+    }
+    else
+    {
+        if (format == 1)
+        {
+            vtoy_out_printf("=== ventoy image location ===\n");
+        }
+        vtoy_print_location_table(param, diskname, location, partstart);
+    }
+
+    free(location);
+    return 0;
+}
+
+#define VTOY_DM_PARAMS_MAX  288
+#define VTOY_DM_ALIGN(x)    (((x) + 7) & ~((size_t)7))
+
+static struct dm_ioctl * vtoy_dm_alloc(const char *name, size_t datasize)
+{
+    struct dm_ioctl *dmi = NULL;
+
+    datasize = VTOY_DM_ALIGN(sizeof(struct dm_ioctl) + datasize);
+    dmi = (struct dm_ioctl *)calloc(1, datasize);
+    if (!dmi)
+    {
+        return NULL;
+    }
+
+    dmi->version[0] = DM_VERSION_MAJOR;
+    dmi->version[1] = 0;
+    dmi->version[2] = 0;
+    dmi->data_size = (uint32_t)datasize;
+    dmi->data_start = (uint32_t)VTOY_DM_ALIGN(sizeof(struct dm_ioctl));
+    snprintf(dmi->name, sizeof(dmi->name), "%s", name);
+    return dmi;
+}
+
+/*
+ * Serialize the location table as DM_TABLE_LOAD payload: a dm_target_spec 
+ * followed by the "device offset" params string for each region.
+ */
+static struct dm_ioctl * vtoy_dm_build_table(ventoy_os_param *param, char *diskname, const char *name,
+                                             ventoy_image_location *location, unsigned long long partstart)
+{
+    uint32_t i;
+    size_t pos;
+    size_t len;
+    char *params = NULL;
+    struct dm_ioctl *dmi = NULL;
+    struct dm_target_spec *spec = NULL;
+    ventoy_image_disk_region *region = NULL;
+    char partname[256] = {0};
+
+    dmi = vtoy_dm_alloc(name, location->region_count * (sizeof(struct dm_target_spec) + VTOY_DM_PARAMS_MAX));
+    if (!dmi)
+    {
+        return NULL;
+    }
+
+    vtoy_get_part_name(diskname, param->vtoy_disk_part_id, partname, sizeof(partname) - 1);
+
+    pos = dmi->data_start;
+    for (i = 0; i < location->region_count; i++)
+    {
+        region = location->regions + i;
+        spec = (struct dm_target_spec *)((char *)dmi + pos);
+        spec->sector_start = (uint64_t)region->image_start_sector * location->image_sector_size / location->disk_sector_size;
+        spec->length = (uint64_t)region->image_sector_count * location->image_sector_size / location->disk_sector_size;
+        snprintf(spec->target_type, sizeof(spec->target_type), "linear");
+
+        params = (char *)(spec + 1);
+        len = snprintf(params, VTOY_DM_PARAMS_MAX, "%s %llu", partname, 
+                       (unsigned long long)region->disk_start_sector - partstart);
+
+        spec->next = (uint32_t)VTOY_DM_ALIGN(sizeof(struct dm_target_spec) + len + 1);
+        pos += spec->next;
+    }
+
+    dmi->target_count = location->region_count;
+    return dmi;
+}
+
+static void vtoy_dm_dump(const char *cmd, struct dm_ioctl *dmi)
+{
+    uint32_t i;
+    size_t pos;
+    struct dm_target_spec *spec = NULL;
+
+    printf("%s version %u.%u.%u data_size %u data_start %u flags 0x%x name %s target_count %u\n",
+           cmd, dmi->version[0], dmi->version[1], dmi->version[2], dmi->data_size, 
+           dmi->data_start, dmi->flags, dmi->name, dmi->target_count);
+
+    pos = dmi->data_start;
+    for (i = 0; i < dmi->target_count; i++)
+    {
+        spec = (struct dm_target_spec *)((char *)dmi + pos);
+        printf("  %llu %llu %s %s\n", (unsigned long long)spec->sector_start, 
+               (unsigned long long)spec->length, spec->target_type, (char *)(spec + 1));
+        pos += spec->next;
+    }
+}
+
+static int vtoy_dm_ioctl(int fd, unsigned long cmd, const char *cmdname, struct dm_ioctl *dmi)
+{
+    if (fd < 0)
+    {
+        vtoy_dm_dump(cmdname, dmi);
+        return 0;
+    }
+
+    debug("%s %s\n", cmdname, dmi->name);
+    if (ioctl(fd, cmd, dmi) < 0)
+    {
+        fprintf(stderr, "%s %s failed %d\n", cmdname, dmi->name, errno);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Create the linear device mapper device for the image directly through
+ * /dev/mapper/control, the same as "dmsetup create NAME table".
+ * With dryrun the ioctl payloads are printed instead.
+ */
+static int vtoy_create_dm(ventoy_os_param *param, char *diskname, const char *name, int dryrun)
+{
+    int fd = -1;
+    int rc = 1;
+    dev_t dev = 0;
+    unsigned long long partstart = 0;
+    ventoy_image_location *location = NULL;
+    struct dm_ioctl *create = NULL;
+    struct dm_ioctl *table = NULL;
+    struct dm_ioctl *resume = NULL;
+    char devpath[256] = {0};
+
+    location = vtoy_get_image_location(param, diskname, &partstart);
+    if (!location)
+    {
+        return 1;
+    }
+
+    create = vtoy_dm_alloc(name, 0);
+    table = vtoy_dm_build_table(param, diskname, name, location, partstart);
+    resume = vtoy_dm_alloc(name, 0);
+    if (!create || !table || !resume)
+    {
+        goto end;
+    }
+
+    if (!dryrun)
+    {
+        fd = open("/dev/mapper/control", O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Failed to open /dev/mapper/control %d\n", errno);
+            goto end;
+        }
+    }
+
+    if (vtoy_dm_ioctl(fd, DM_DEV_CREATE, "DM_DEV_CREATE", create))
+    {
+        goto end;
+    }
+    dev = (dev_t)create->dev;
+
+    /* resume a suspended device makes the loaded table live */
+    if (vtoy_dm_ioctl(fd, DM_TABLE_LOAD, "DM_TABLE_LOAD", table) || 
+        vtoy_dm_ioctl(fd, DM_DEV_SUSPEND, "DM_DEV_SUSPEND", resume))
+    {
+        /* ioctls overwrite the header, so remove with a fresh one */
+        free(create);
+        create = vtoy_dm_alloc(name, 0);
+        if (create)
+        {
+            vtoy_dm_ioctl(fd, DM_DEV_REMOVE, "DM_DEV_REMOVE", create);
+        }
+        goto end;
+    }
+
+    /* without udev nobody creates the device node */
+    snprintf(devpath, sizeof(devpath), "/dev/mapper/%s", name);
+    if (!dryrun && access(devpath, F_OK) < 0)
+    {
+        debug("create device node %s %u:%u\n", devpath, major(dev), minor(dev));
+        if (mknod(devpath, S_IFBLK | 0600, dev) < 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Failed to create %s %d\n", devpath, errno);
+        }
+    }
+
+    rc = 0;
+
+end:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(create);
+    free(table);
+    free(resume);
+    free(location);
+    return rc;
+}
+
+static int vtoy_region_cmp(const void *a, const void *b)
+{
+    const ventoy_image_disk_region *ra = (const ventoy_image_disk_region *)a;
+    const ventoy_image_disk_region *rb = (const ventoy_image_disk_region *)b;
+
+    if (ra->image_start_sector != rb->image_start_sector)
+    {
+        return (ra->image_start_sector < rb->image_start_sector) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Convert the location table into disk byte ranges in image order, 
+ * clipped to the image size.
+ */
+static vtoy_extent * vtoy_get_extents(ventoy_image_location *location, uint64_t imgsize, int *count)
+{
+    uint32_t i;
+    uint64_t pos = 0;
+    uint64_t length;
+    vtoy_extent *extents = NULL;
+    ventoy_image_disk_region *regions = NULL;
+
+    regions = (ventoy_image_disk_region *)malloc(location->region_count * sizeof(ventoy_image_disk_region));
+    extents = (vtoy_extent *)malloc(location->region_count * sizeof(vtoy_extent));
+    if (!regions || !extents)
+    {
+        free(regions);
+        free(extents);
+        return NULL;
+    }
+
+    memcpy(regions, location->regions, location->region_count * sizeof(ventoy_image_disk_region));
+    qsort(regions, location->region_count, sizeof(ventoy_image_disk_region), vtoy_region_cmp);
+
+    *count = 0;
+    for (i = 0; i < location->region_count && pos < imgsize; i++)
+    {
+        if ((uint64_t)regions[i].image_start_sector * location->image_sector_size != pos)
+        {
+            fprintf(stderr, "Image location has a hole at %llu\n", (unsigned long long)pos);
+            free(regions);
+            free(extents);
+            return NULL;
+        }
+
+        length = (uint64_t)regions[i].image_sector_count * location->image_sector_size;
+        if (pos + length > imgsize)
+        {
+            length = imgsize - pos;
+        }
+
+        extents[*count].offset = regions[i].disk_start_sector * location->disk_sector_size;
+        extents[*count].length = length;
+        (*count)++;
+        pos += length;
+    }
+    free(regions);
+
+    /* the table counts whole image sectors, the tail of a partial last sector follows the last region */
+    if (*count > 0 && pos < imgsize && imgsize - pos < location->image_sector_size)
+    {
+        extents[*count - 1].length += imgsize - pos;
+        pos = imgsize;
+    }
+
+    if (pos < imgsize)
+    {
+        fprintf(stderr, "Image location covers only %llu of %llu bytes\n", 
+                (unsigned long long)pos, (unsigned long long)imgsize);
+        free(extents);
+        return NULL;
+    }
+
+    return extents;
+}
+
+/*
+ * Zero copy in the kernel: copy_file_range() to a regular file, splice() to a pipe.
+ * Return 1 if the destination does not support it, the rest is left to 
+ * the buffered pipeline then.
+ */
+static int vtoy_stream_direct(vtoy_stream *st, int usesplice)
+{
+    ssize_t len;
+    uint64_t chunk;
+    loff_t off;
+    vtoy_extent *ext = NULL;
+
+    for (; st->cur < st->count; st->cur++, st->pos = 0)
+    {
+        ext = st->extents + st->cur;
+        while (st->pos < ext->length)
+        {
+            off = (loff_t)(ext->offset + st->pos);
+            chunk = MIN(ext->length - st->pos, VTOY_STREAM_DIRECT_MAX);
+
+            if (usesplice)
+            {
+                len = splice(st->diskfd, &off, st->outfd, NULL, (size_t)chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            }
+            else
+            {
+                len = copy_file_range(st->diskfd, &off, st->outfd, NULL, (size_t)chunk, 0);
+            }
+
+            if (len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (len < 0 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP))
+            {
+                debug("%s not supported %d, use read/write\n", usesplice ? "splice" : "copy_file_range", errno);
+                return 1;
+            }
+            else if (len <= 0)
+            {
+                fprintf(stderr, "Failed to copy image data at disk offset %llu %d\n", (unsigned long long)off, errno);
+                return -1;
+            }
+
+            st->pos += len;
+        }
+    }
+
+    return 0;
+}
+
+static void * vtoy_stream_reader(void *arg)
+{
+    int slot;
+    ssize_t len;
+    size_t size;
+    size_t done;
+    vtoy_extent *ext = NULL;
+    vtoy_stream *st = (vtoy_stream *)arg;
+
+    for (; st->cur < st->count; st->cur++, st->pos = 0)
+    {
+        ext = st->extents + st->cur;
+        while (st->pos < ext->length)
+        {
+            pthread_mutex_lock(&st->lock);
+            while (st->filled == VTOY_STREAM_BUFS && !st->error)
+            {
+                pthread_cond_wait(&st->cond, &st->lock);
+            }
+            slot = st->head;
+            pthread_mutex_unlock(&st->lock);
+
+            if (st->error)
+            {
+                goto end;
+            }
+
+            size = (size_t)MIN(ext->length - st->pos, VTOY_STREAM_CHUNK);
+            for (done = 0; done < size; done += len)
+            {
+                len = pread(st->diskfd, st->bufs[slot] + done, size - done, (off_t)(ext->offset + st->pos + done));
+                if (len < 0 && errno == EINTR)
+                {
+                    len = 0;
+                }
+                else if (len <= 0)
+                {
+                    fprintf(stderr, "Failed to read image data at disk offset %llu %d\n", 
+                            (unsigned long long)(ext->offset + st->pos + done), errno);
+                    pthread_mutex_lock(&st->lock);
+                    st->error = 1;
+                    pthread_cond_broadcast(&st->cond);
+                    pthread_mutex_unlock(&st->lock);
+                    goto end;
+                }
+            }
+
+            pthread_mutex_lock(&st->lock);
+            st->lens[slot] = size;
+            st->head = (st->head + 1) % VTOY_STREAM_BUFS;
+            st->filled++;
+            pthread_cond_broadcast(&st->cond);
+            pthread_mutex_unlock(&st->lock);
+
+            st->pos += size;
+        }
+    }
+
+end:
+    pthread_mutex_lock(&st->lock);
+    st->eof = 1;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/*
+ * Read ahead pipeline: a reader thread fills VTOY_STREAM_BUFS aligned 
+ * buffers with large reads while the current thread writes them out in order.
+ */
+static int vtoy_stream_pipeline(vtoy_stream *st)
+{
+    int i;
+    int slot;
+    ssize_t len;
+    size_t done;
+    pthread_t tid;
+
+    for (i = 0; i < VTOY_STREAM_BUFS; i++)
+    {
+        if (posix_memalign((void **)&st->bufs[i], 4096, VTOY_STREAM_CHUNK))
+        {
+            st->bufs[i] = NULL;
+            return 1;
+        }
+    }
+
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->cond, NULL);
+    if (pthread_create(&tid, NULL, vtoy_stream_reader, st))
+    {
+        pthread_cond_destroy(&st->cond);
+        pthread_mutex_destroy(&st->lock);
+        return 1;
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&st->lock);
+        while (st->filled == 0 && !st->eof && !st->error)
+        {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        slot = st->tail;
+        pthread_mutex_unlock(&st->lock);
+
+        if (st->error || st->filled == 0)
+        {
+            break;
+        }
+
+        for (done = 0; done < st->lens[slot]; done += len)
+        {
+            len = write(st->outfd, st->bufs[slot] + done, st->lens[slot] - done);
+            if (len < 0 && errno == EINTR)
+            {
+                len = 0;
+            }
+            else if (len <= 0)
+            {
+                fprintf(stderr, "Failed to write image data %d\n", errno);
+                pthread_mutex_lock(&st->lock);
+                st->error = 1;
+                pthread_cond_broadcast(&st->cond);
+                pthread_mutex_unlock(&st->lock);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&st->lock);
+        st->tail = (st->tail + 1) % VTOY_STREAM_BUFS;
+        st->filled--;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    pthread_join(tid, NULL);
+    pthread_cond_destroy(&st->cond);
+    pthread_mutex_destroy(&st->lock);
+    return st->error;
+}
+
+/*
+ * Stream the image from the raw disk by walking its regions, 
+ * to dest file or to stdout if dest is NULL.
+ */
+static int vtoy_stream_image(ventoy_os_param *param, char *diskname, const char *dest)
+{
+    int i;
+    int rc = 1;
+    unsigned long long partstart = 0;
+    struct stat st_out;
+    vtoy_stream st;
+    ventoy_image_location *location = NULL;
+    char devdisk[256] = {0};
+
+    memset(&st, 0, sizeof(st));
+    st.diskfd = st.outfd = -1;
+
+    location = vtoy_get_image_location(param, diskname, &partstart);
+    if (!location)
+    {
+        return 1;
+    }
+
+    st.extents = vtoy_get_extents(location, param->vtoy_img_size, &st.count);
+    if (!st.extents)
+    {
+        goto end;
+    }
+
+    snprintf(devdisk, sizeof(devdisk) - 1, "/dev/%s", diskname);
+    st.diskfd = open(devdisk, O_RDONLY | O_BINARY);
+    if (st.diskfd < 0)
+    {
+        fprintf(stderr, "Failed to open %s %d\n", devdisk, errno);
+        goto end;
+    }
+    posix_fadvise(st.diskfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    st.outfd = dest ? open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644) : STDOUT_FILENO;
+    if (st.outfd < 0)
+    {
+        fprintf(stderr, "Failed to create %s %d\n", dest, errno);
+        goto end;
+    }
+
+    if (fstat(st.outfd, &st_out) == 0 && (S_ISREG(st_out.st_mode) || S_ISFIFO(st_out.st_mode)))
+    {
+        rc = vtoy_stream_direct(&st, S_ISFIFO(st_out.st_mode));
+    }
+
+    if (rc > 0)
+    {
+        rc = vtoy_stream_pipeline(&st);
+    }
+
+    if (rc == 0 && dest && fsync(st.outfd) < 0)
+    {
+        fprintf(stderr, "Failed to sync %s %d\n", dest, errno);
+        rc = 1;
+    }
+
+end:
+    if (st.diskfd >= 0)
+    {
+        close(st.diskfd);
+    }
+    if (dest && st.outfd >= 0)
+    {
+        close(st.outfd);
+    }
+    for (i = 0; i < VTOY_STREAM_BUFS; i++)
+    {
+        free(st.bufs[i]);
+    }
+    free(st.extents);
+    free(location);
+    return rc ? 1 : 0;
+}
+
+static void * vtoy_verify_reader(void *arg)
+{
+    int i;
+    int slot;
+    ssize_t len;
+    size_t done;
+    vtoy_extent *chunk = NULL;
+    vtoy_verify *vf = (vtoy_verify *)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&vf->lock);
+        for (slot = -1; slot < 0 && !vf->error && vf->next < vf->count; )
+        {
+            for (i = 0; i < VTOY_VERIFY_BUFS; i++)
+            {
+                if (vf->seq[i] < 0)
+                {
+                    slot = i;
+                    break;
+                }
+            }
+
+            if (slot < 0)
+            {
+                pthread_cond_wait(&vf->cond, &vf->lock);
+            }
+        }
+
+        if (slot < 0)
+        {
+            pthread_mutex_unlock(&vf->lock);
+            break;
+        }
+
+        vf->seq[slot] = vf->next++;
+        vf->ready[slot] = 0;
+        chunk = vf->chunks + vf->seq[slot];
+        pthread_mutex_unlock(&vf->lock);
+
+        for (done = 0; done < chunk->length; done += len)
+        {
+            len = pread(vf->diskfd, vf->bufs[slot] + done, chunk->length - done, (off_t)(chunk->offset + done));
+            if (len < 0 && errno == EINTR)
+            {
+                len = 0;
+            }
+            else if (len <= 0)
+            {
+                fprintf(stderr, "Failed to read image data at disk offset %llu %d\n", 
+                        (unsigned long long)(chunk->offset + done), errno);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&vf->lock);
+        if (done < chunk->length)
+        {
+            vf->error = 1;
+        }
+        vf->ready[slot] = 1;
+        pthread_cond_broadcast(&vf->cond);
+        pthread_mutex_unlock(&vf->lock);
+    }
+
+    return NULL;
+}
+
+/* split the extents into pieces of at most VTOY_STREAM_CHUNK bytes */
+static vtoy_extent * vtoy_split_extents(vtoy_extent *extents, int count, int *chunkcount)
+{
+    int i;
+    int n = 0;
+    uint64_t pos;
+    vtoy_extent *chunks = NULL;
+
+    for (i = 0; i < count; i++)
+    {
+        n += (int)((extents[i].length + VTOY_STREAM_CHUNK - 1) / VTOY_STREAM_CHUNK);
     }
 
-    if (!location)
+    chunks = (vtoy_extent *)malloc((n ? n : 1) * sizeof(vtoy_extent));
+    if (!chunks)
     {
-        if (param->vtoy_disk_part_type == 0)
+        return NULL;
+    }
+
+    for (i = 0, n = 0; i < count; i++)
+    {
+        for (pos = 0; pos < extents[i].length; pos += VTOY_STREAM_CHUNK)
         {
-            debug("get image location by fs tool\n");
-            snprintf(dmdisk, sizeof(dmdisk) - 1, "/dev/%s%d", diskname, param->vtoy_disk_part_id);
-            location = ventoy_get_location_by_lsexfat(diskname, param->vtoy_disk_part_id, param->vtoy_img_path);
+            chunks[n].offset = extents[i].offset + pos;
+            chunks[n].length = MIN(extents[i].length - pos, VTOY_STREAM_CHUNK);
+            n++;
         }
     }
 
-    if (!location)
+    *chunkcount = n;
+    return chunks;
+}
+
+/*
+ * Verify the image read from the raw disk against a MD5 or SHA-256 hex string.
+ * VTOY_VERIFY_THREADS threads read the chunks in parallel into a pool of
+ * VTOY_VERIFY_BUFS buffers, and the current thread hashes them in order.
+ */
+static int vtoy_verify_image(ventoy_os_param *param, char *diskname, const char *expect)
+{
+    int i;
+    int rc = 1;
+    int slot;
+    int type;
+    int len;
+    int nthread = 0;
+    int extcount = 0;
+    int failed = 0;
+    double seconds;
+    unsigned long long partstart = 0;
+    struct timespec begin;
+    struct timespec end;
+    vtoy_verify vf;
+    vtoy_hash_ctx ctx;
+    pthread_t tids[VTOY_VERIFY_THREADS];
+    vtoy_extent *extents = NULL;
+    ventoy_image_location *location = NULL;
+    uint8_t digest[VTOY_HASH_MAX_LEN];
+    char hex[VTOY_HASH_MAX_LEN * 2 + 1];
+    char devdisk[256] = {0};
+
+    if (strlen(expect) == VTOY_MD5_LEN * 2)
     {
-        fprintf(stderr, "Failed to find image location\n");
+        type = VTOY_HASH_MD5;
+    }
+    else if (strlen(expect) == VTOY_SHA256_LEN * 2)
+    {
+        type = VTOY_HASH_SHA256;
+    }
+    else
+    {
+        fprintf(stderr, "Invalid hash %s, MD5 or SHA-256 hex string is needed\n", expect);
         return 1;
     }
 
-    if (memcmp(&vtoy_guid, &location->guid, sizeof(ventoy_guid)))
+    memset(&vf, 0, sizeof(vf));
+    vf.diskfd = -1;
+    for (i = 0; i < VTOY_VERIFY_BUFS; i++)
+    {
+        vf.seq[i] = -1;
+    }
+
+    location = vtoy_get_image_location(param, diskname, &partstart);
+    if (!location)
     {
-        free(location);
-        fprintf(stderr, "Image location data corrupted\n");
         return 1;
     }
 
-    if (format == 1)
+    extents = vtoy_get_extents(location, param->vtoy_img_size, &extcount);
+    if (!extents)
     {
-        printf("=== ventoy image location ===\n");
+        goto end;
     }
 
-    if (strstr(diskname, "nvme") || strstr(diskname, "mmc") || strstr(diskname, "nbd"))
+    vf.chunks = vtoy_split_extents(extents, extcount, &vf.count);
+    if (!vf.chunks)
     {
-        partflag = 1;
-        snprintf(sysstart, sizeof(sysstart) - 1, "/sys/class/block/%sp%u/start", diskname, param->vtoy_disk_part_id);
-        
+        goto end;
     }
-    else
+
+    snprintf(devdisk, sizeof(devdisk) - 1, "/dev/%s", diskname);
+    vf.diskfd = open(devdisk, O_RDONLY | O_BINARY);
+    if (vf.diskfd < 0)
     {
-        snprintf(sysstart, sizeof(sysstart) - 1, "/sys/class/block/%s%u/start", diskname, param->vtoy_disk_part_id);
+        fprintf(stderr, "Failed to open %s %d\n", devdisk, errno);
+        goto end;
     }
 
-    partstart = 2048;
-    if (access(sysstart, F_OK) >= 0)
+    for (i = 0; i < VTOY_VERIFY_BUFS; i++)
     {
-        debug("get part start from sysfs for %s\n", sysstart);
-        
-        fd = open(sysstart, O_RDONLY | O_BINARY);
-        if (fd >= 0)
+        if (posix_memalign((void **)&vf.bufs[i], 4096, VTOY_STREAM_CHUNK))
         {
-            read(fd, valuebuf, sizeof(valuebuf));
-            partstart = strtoull(valuebuf, NULL, 10);
-            close(fd);
+            vf.bufs[i] = NULL;
+            goto end;
         }
     }
-    else
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    vtoy_hash_init(&ctx, type);
+
+    pthread_mutex_init(&vf.lock, NULL);
+    pthread_cond_init(&vf.cond, NULL);
+    for (i = 0; i < VTOY_VERIFY_THREADS; i++)
     {
-        debug("%s not exist \n", sysstart);
+        if (pthread_create(tids + nthread, NULL, vtoy_verify_reader, &vf) == 0)
+        {
+            nthread++;
+        }
     }
 
-    /* print location in dmsetup table format */
-    for (i = 0; i < (int)location->region_count; i++)
+    if (nthread == 0)
     {
-        region = location->regions + i;
-        start = region->image_start_sector;
-        count = region->image_sector_count;
+        vf.error = 1;
+    }
 
-        if (partflag)
+    /* hash the chunks in image order */
+    for (i = 0; i < vf.count; i++)
+    {
+        pthread_mutex_lock(&vf.lock);
+        for (;;)
         {
-            printf("%llu %llu linear %sp%u %llu\n", 
-                   start * location->image_sector_size / location->disk_sector_size,
-                   count * location->image_sector_size / location->disk_sector_size,
-                   dmdisk, param->vtoy_disk_part_id,
-                   (unsigned long long)region->disk_start_sector - partstart);
+            for (slot = 0; slot < VTOY_VERIFY_BUFS; slot++)
+            {
+                if (vf.seq[slot] == i && vf.ready[slot])
+                {
+                    break;
+                }
+            }
+
+            if (slot < VTOY_VERIFY_BUFS || vf.error)
+            {
+                break;
+            }
+            pthread_cond_wait(&vf.cond, &vf.lock);
         }
-        else
+        failed = vf.error;
+        pthread_mutex_unlock(&vf.lock);
+
+        if (failed)
         {
-            printf("%llu %llu linear %s%u %llu\n", 
-                   start * location->image_sector_size / location->disk_sector_size,
-                   count * location->image_sector_size / location->disk_sector_size,
-                   dmdisk, param->vtoy_disk_part_id,
-                   (unsigned long long)region->disk_start_sector - partstart);
+            break;
         }
+
+        vtoy_hash_update(&ctx, vf.bufs[slot], (size_t)vf.chunks[i].length);
+
+        pthread_mutex_lock(&vf.lock);
+        vf.seq[slot] = -1;
+        pthread_cond_broadcast(&vf.cond);
+        pthread_mutex_unlock(&vf.lock);
+    }
+
+    pthread_mutex_lock(&vf.lock);
+    if (i < vf.count)
+    {
+        vf.error = 1;
+    }
+    pthread_cond_broadcast(&vf.cond);
+    pthread_mutex_unlock(&vf.lock);
+
+    for (i = 0; i < nthread; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_cond_destroy(&vf.cond);
+    pthread_mutex_destroy(&vf.lock);
+
+    if (vf.error)
+    {
+        goto end;
+    }
+
+    len = vtoy_hash_final(&ctx, digest);
+    for (i = 0; i < len; i++)
+    {
+        sprintf(hex + i * 2, "%02x", digest[i]);
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+    rc = strcasecmp(hex, expect) ? 1 : 0;
+    printf("%s %s %s\n", (type == VTOY_HASH_MD5) ? "md5" : "sha256", hex, rc ? "MISMATCH" : "OK");
+    printf("%llu bytes in %.2f seconds, %.1f MB/s\n", (unsigned long long)param->vtoy_img_size, seconds,
+           seconds > 0 ? param->vtoy_img_size / seconds / 1048576 : 0.0);
+
+end:
+    if (vf.diskfd >= 0)
+    {
+        close(vf.diskfd);
+    }
+    for (i = 0; i < VTOY_VERIFY_BUFS; i++)
+    {
+        free(vf.bufs[i]);
+    }
+    free(vf.chunks);
+    free(extents);
     free(location);
-    return 0;
+    return rc;
+}
+
+/*
+ * Batch mode: mount the ventoy partition once and print the location table
+ * for every image path listed in the file (one path per line, "-" for stdin).
+ */
+static int vtoy_print_batch_location(ventoy_os_param *param, char *diskname, const char *listfile)
+{
+    int i;
+    int rc = 0;
+    int count = 0;
+    int maxcount = 0;
+    unsigned long long partstart;
+    char line[512];
+    char **paths = NULL;
+    char **newpaths = NULL;
+    FILE *fp = NULL;
+    ventoy_image_location **locations = NULL;
+
+    if (param->vtoy_disk_part_type != 0)
+    {
+        fprintf(stderr, "Batch mode is only supported for exfat\n");
+        return 1;
+    }
+
+    fp = (strcmp(listfile, "-") == 0) ? stdin : fopen(listfile, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s %d\n", listfile, errno);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0)
+        {
+            continue;
+        }
+
+        if (count == maxcount)
+        {
+            maxcount = maxcount ? maxcount * 2 : 32;
+            newpaths = (char **)realloc(paths, maxcount * sizeof(char *));
+            if (!newpaths)
+            {
+                rc = 1;
+                break;
+            }
+            paths = newpaths;
+        }
+
+        paths[count] = strdup(line);
+        if (!paths[count])
+        {
+            rc = 1;
+            break;
+        }
+        count++;
+    }
+
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+
+    if (rc == 0 && count > 0)
+    {
+        locations = (ventoy_image_location **)malloc(count * sizeof(ventoy_image_location *));
+        if (locations)
+        {
+            if (ventoy_get_locations_by_lsexfat(diskname, param->vtoy_disk_part_id, count, (const char **)paths, locations))
+            {
+                rc = 1;
+            }
+
+            partstart = vtoy_get_part_start(param, diskname);
+            for (i = 0; i < count; i++)
+            {
+                if (locations[i])
+                {
+                    vtoy_location_to_disk(locations[i], partstart);
+                }
+            }
+
+            if (outfmt == VTOY_OUT_JSON)
+            {
+                vtoy_out_json_key("images");
+                vtoy_out_write("[", 1);
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                if (outfmt == VTOY_OUT_JSON)
+                {
+                    vtoy_out_printf("%s{\"path\":", i ? "," : "");
+                    vtoy_out_json_str(paths[i]);
+                    vtoy_out_printf(",\"location\":");
+                    if (locations[i])
+                    {
+                        vtoy_print_location_table(param, diskname, locations[i], partstart);
+                    }
+                    else
+                    {
+                        vtoy_out_printf("null");
+                    }
+                    vtoy_out_write("}", 1);
+                }
+                else if (locations[i] && outfmt == VTOY_OUT_BIN)
+                {
+                    /* image size is not known in batch mode */
+                    vtoy_out_bin_record(param, diskname, paths[i], 0, locations[i], partstart);
+                }
+                else if (locations[i])
+                {
+                    vtoy_out_printf("=== %s ===\n", paths[i]);
+                    vtoy_print_location_table(param, diskname, locations[i], partstart);
+                }
+                free(locations[i]);
+            }
+
+            if (outfmt == VTOY_OUT_JSON)
+            {
+                vtoy_out_write("]", 1);
+            }
+            free(locations);
+        }
+        else
+        {
+            rc = 1;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        free(paths[i]);
+    }
+    free(paths);
+
+    return rc;
 }
 
 int vtoy_print_os_param(ventoy_os_param *param, char *diskname)
@@ -637,13 +3108,34 @@ int vtoy_print_os_param(ventoy_os_param *param, char *diskname)
         fs = vtoy_fs_type[param->vtoy_disk_part_type];
     }
 
-    printf("=== ventoy runtime data ===\n");
-    printf("disk name : /dev/%s\n", diskname);
-    printf("disk size : %llu\n", (unsigned long long)param->vtoy_disk_size);
-    printf("disk part : %u\n", param->vtoy_disk_part_id);
-    printf("filesystem: %s\n", fs);
-    printf("image size: %llu\n", (unsigned long long)param->vtoy_img_size);
-    printf("image path: %s\n", param->vtoy_img_path);
+    if (outfmt == VTOY_OUT_BIN)
+    {
+        /* with -l the record is written together with the location table */
+        if (format == 0)
+        {
+            vtoy_out_bin_record(param, diskname, param->vtoy_img_path, param->vtoy_img_size, NULL, 0);
+        }
+        return 0;
+    }
+
+    if (outfmt == VTOY_OUT_JSON)
+    {
+        vtoy_out_json_key("runtime");
+        vtoy_out_printf("{\"disk_name\":\"/dev/%s\",\"disk_size\":%llu,\"disk_part\":%u,\"filesystem\":\"%s\","
+                        "\"image_size\":%llu,\"image_path\":", diskname, (unsigned long long)param->vtoy_disk_size,
+                        param->vtoy_disk_part_id, fs, (unsigned long long)param->vtoy_img_size);
+        vtoy_out_json_str(param->vtoy_img_path);
+        vtoy_out_write("}", 1);
+        return 0;
+    }
+
+    vtoy_out_printf("=== ventoy runtime data ===\n");
+    vtoy_out_printf("disk name : /dev/%s\n", diskname);
+    vtoy_out_printf("disk size : %llu\n", (unsigned long long)param->vtoy_disk_size);
+    vtoy_out_printf("disk part : %u\n", param->vtoy_disk_part_id);
+    vtoy_out_printf("filesystem: %s\n", fs);
+    vtoy_out_printf("image size: %llu\n", (unsigned long long)param->vtoy_img_size);
+    vtoy_out_printf("image path: %s\n", param->vtoy_img_path);
 
     return 0;
 }
@@ -655,14 +3147,36 @@ void print_usage(void)
     * none      print ventoy runtime data
     * -l        print ventoy runtime data and image location table
     * -L        only print image location table (used to generate dmsetup table)
+    * -B file   print image location table for every image path listed in file
+    * -n        do not use the cache in /run
+    * --wait[=timeout]  wait for the ventoy disk to be plugged in
+    * --mem=start[,len] physical memory window searched in legacy bios mode
+    * --format=FMT      output format text/json/bin
+    * --cat             stream the image from the raw disk to stdout
+    * --copy DEST       copy the image from the raw disk to DEST
+    * --verify HASH     verify the image from the raw disk by MD5/SHA-256
+    * --create-dm NAME  create device mapper device NAME through DM ioctls
+    * --dry-run         print the DM ioctl payloads instead of issuing them
     * -v        be verbose
     */
 
-    printf("Usage: vtoydump [ -lL ] [ -v ]\n");
+    printf("Usage: vtoydump [ -lLcnvh ] [ -B pathlist ] [ --format=FMT ] [ --wait[=timeout] ] [ --mem=start[,len] ]\n");
+    printf("                [ --cat | --copy DEST | --verify HASH | --create-dm NAME [ --dry-run ] ]\n");
     printf("  none   Only print ventoy runtime data\n");
     printf("  -l     Print ventoy runtime data and image location table\n");
     printf("  -L     Only print image location table (used to generate dmsetup table)\n");
+    printf("  -B     Print image location table for every path listed in file (- for stdin)\n");
     printf("  -c     Check whether ventoy runtime data exist\n");
+    printf("  -n     Do not use the cache in %s\n", VTOY_CACHE_FILE);
+    printf("  --format=FMT       Output format: text (default), json or bin (see vtoy_bin_header)\n");
+    printf("  --cat              Write the image content read from the raw disk to stdout\n");
+    printf("  --copy DEST        Copy the image content read from the raw disk to file DEST\n");
+    printf("  --verify HASH      Verify the image read from the raw disk against a MD5 or SHA-256 hex string\n");
+    printf("  --create-dm NAME   Create device mapper device NAME for the image (no dmsetup needed)\n");
+    printf("  --dry-run          With --create-dm, print the ioctl payloads instead\n");
+    printf("  --mem=start[,len]  Physical memory window to search ventoy runtime data in legacy bios mode\n");
+    printf("                     (default 0x%x,0x%x)\n", SEARCH_MEM_START, SEARCH_MEM_LEN);
+    printf("  --wait[=timeout]   Wait (at most timeout seconds) for the ventoy disk to show up\n");
     printf("  -v     Verbose, print additional debug info\n");
     printf("  -h     Print this help info\n");
     printf("\n");
@@ -674,15 +3188,42 @@ int main(int argc, char **argv)
     int rc;
     int ch;
     int check = 0;
+    int waitdisk = 0;
+    int timeout = -1;
+    int ueventfd = -1;
+    long value = 0;
+    int dryrun = 0;
+    char *end = NULL;
+    int stream = 0;
+    const char *dmname = NULL;
+    const char *copydest = NULL;
+    const char *verifyhash = NULL;
+    const char *batchfile = NULL;
     char diskname[256] = { 0 };
     ventoy_os_param param;
-
-    while ((ch = getopt(argc, argv, "l::L::c::v::h::")) != -1)
+    static struct option options[] =
+    {
+        { "wait", optional_argument, NULL, 'w' },
+        { "mem", required_argument, NULL, 'm' },
+        { "create-dm", required_argument, NULL, 'D' },
+        { "dry-run", no_argument, NULL, 'N' },
+        { "format", required_argument, NULL, 'F' },
+        { "cat", no_argument, NULL, 'C' },
+        { "copy", required_argument, NULL, 'O' },
+        { "verify", required_argument, NULL, 'H' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((ch = getopt_long(argc, argv, "l::L::B:c::n::v::h::", options, NULL)) != -1)
     {
         if (ch == 'l')
         {
             format = 1;
         }
+        else if (ch == 'B')
+        {
+            batchfile = optarg;
+        }
         else if (ch == 'L')
         {
             format = 2;
@@ -691,6 +3232,81 @@ int main(int argc, char **argv)
         {
             check = 1;
         }
+        else if (ch == 'n')
+        {
+            use_cache = 0;
+        }
+        else if (ch == 'w')
+        {
+            waitdisk = 1;
+            if (optarg)
+            {
+                errno = 0;
+                value = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || value <= 0 || value > VTOY_WAIT_MAX)
+                {
+                    fprintf(stderr, "Invalid wait timeout %s\n", optarg);
+                    return 1;
+                }
+                timeout = (int)value;
+            }
+        }
+        else if (ch == 'm')
+        {
+            errno = 0;
+            g_mem_start = strtoull(optarg, &end, 0);
+            if (end != optarg && *end == ',')
+            {
+                g_mem_len = (size_t)strtoull(end + 1, &end, 0);
+            }
+
+            if (errno || end == optarg || *end || strchr(optarg, '-') || g_mem_len == 0)
+            {
+                fprintf(stderr, "Invalid memory window %s\n", optarg);
+                return 1;
+            }
+        }
+        else if (ch == 'F')
+        {
+            if (strcmp(optarg, "text") == 0)
+            {
+                outfmt = VTOY_OUT_TEXT;
+            }
+            else if (strcmp(optarg, "json") == 0)
+            {
+                outfmt = VTOY_OUT_JSON;
+            }
+            else if (strcmp(optarg, "bin") == 0)
+            {
+                outfmt = VTOY_OUT_BIN;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid format %s\n", optarg);
+                return 1;
+            }
+        }
+        else if (ch == 'C')
+        {
+            stream = 1;
+        }
+        else if (ch == 'O')
+        {
+            stream = 1;
+            copydest = optarg;
+        }
+        else if (ch == 'H')
+        {
+            verifyhash = optarg;
+        }
+        else if (ch == 'D')
+        {
+            dmname = optarg;
+        }
+        else if (ch == 'N')
+        {
+            dryrun = 1;
+        }
         else if (ch == 'v')
         {
             verbose = 1;
@@ -706,6 +3322,12 @@ int main(int argc, char **argv)
         }
     }
 
+    /* keep the json and bin output parsable and the image streamed by --cat intact */
+    if (outfmt != VTOY_OUT_TEXT || (stream && !copydest))
+    {
+        debug_out = stderr;
+    }
+
     memset(&param, 0, sizeof(ventoy_os_param));
 
     rc = vtoy_os_param_from_acpi(&param);
@@ -735,17 +3357,79 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    rc = vtoy_find_disk(&param, diskname, (int)(sizeof(diskname)-1));
+    if (use_cache && !batchfile && vtoy_load_cache(&param, diskname, (int)(sizeof(diskname)-1)) == 0)
+    {
+        rc = 0;
+    }
+    else
+    {
+        /* listen before the scan, so that a disk added meanwhile is not missed */
+        if (waitdisk)
+        {
+            ueventfd = vtoy_open_uevent();
+            if (ueventfd < 0)
+            {
+                fprintf(stderr, "Failed to listen for uevents, can not wait\n");
+            }
+        }
+
+        rc = vtoy_find_disk(&param, diskname, (int)(sizeof(diskname)-1));
+        if (rc && ueventfd >= 0)
+        {
+            debug("wait for ventoy disk, timeout %d\n", timeout);
+            rc = vtoy_wait_disk(ueventfd, &param, timeout, diskname, (int)(sizeof(diskname)-1));
+        }
+
+        if (ueventfd >= 0)
+        {
+            close(ueventfd);
+        }
+
+        if (rc == 0 && format == 0 && !dmname && !stream && !verifyhash)
+        {
+            vtoy_save_cache(&param, diskname, vtoy_get_part_start(&param, diskname), NULL);
+        }
+    }
+
+    if (rc == 0 && dmname)
+    {
+        return vtoy_create_dm(&param, diskname, dmname, dryrun);
+    }
+
+    if (rc == 0 && verifyhash)
+    {
+        return vtoy_verify_image(&param, diskname, verifyhash);
+    }
+
+    if (rc == 0 && stream)
+    {
+        return vtoy_stream_image(&param, diskname, copydest);
+    }
+
     if (rc == 0)
     {
-        if (format == 0 || format == 1)
+        vtoy_out_begin();
+
+        if (batchfile)
         {
-            vtoy_print_os_param(&param, diskname);
+            rc = vtoy_print_batch_location(&param, diskname, batchfile);
+        }
+        else
+        {
+            if (format == 0 || format == 1)
+            {
+                vtoy_print_os_param(&param, diskname);
+            }
+
+            if (format == 1 || format == 2)
+            {
+                vtoy_print_image_location(&param, diskname);
+            }
         }
 
-        if (format == 1 || format == 2)
+        if (vtoy_out_end())
         {
-            vtoy_print_image_location(&param, diskname);
+            rc = 1;
         }
     }
 
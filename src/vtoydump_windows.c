@@ -105,6 +105,7 @@ if (handle != INVALID_HANDLE_VALUE) \
 #define LASTERR     GetLastError()
 
 int verbose = 0;
+FILE *debug_out = NULL;
 static ventoy_guid vtoy_guid = VENTOY_GUID;
 static INT g_system_bit = VTOY_BIT;
 
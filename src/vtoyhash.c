@@ -0,0 +1,278 @@
+/******************************************************************************
+ * vtoyhash.c  ---- MD5 (RFC 1321) and SHA-256 (FIPS 180-4) used to verify the image
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vtoyhash.h>
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t md5_k[64] =
+{
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t md5_r[64] =
+{
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void md5_transform(uint32_t *state, const uint8_t *block)
+{
+    int i;
+    uint32_t a, b, c, d, f, g, t;
+    uint32_t m[16];
+
+    for (i = 0; i < 16; i++)
+    {
+        m[i] = (uint32_t)block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8) |
+               ((uint32_t)block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+
+    for (i = 0; i < 64; i++)
+    {
+        if (i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if (i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        }
+        else if (i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+
+        t = d;
+        d = c;
+        c = b;
+        b = b + ROL32(a + f + md5_k[i] + m[g], md5_r[i]);
+        a = t;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void sha256_transform(uint32_t *state, const uint8_t *block)
+{
+    int i;
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    uint32_t w[64];
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+
+    for (i = 16; i < 64; i++)
+    {
+        w[i] = w[i - 16] + (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               w[i - 7] + (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+
+    for (i = 0; i < 64; i++)
+    {
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void hash_transform(vtoy_hash_ctx *ctx, const uint8_t *block)
+{
+    if (ctx->type == VTOY_HASH_MD5)
+    {
+        md5_transform(ctx->state, block);
+    }
+    else
+    {
+        sha256_transform(ctx->state, block);
+    }
+}
+
+void vtoy_hash_init(vtoy_hash_ctx *ctx, int type)
+{
+    memset(ctx, 0, sizeof(vtoy_hash_ctx));
+    ctx->type = type;
+
+    if (type == VTOY_HASH_MD5)
+    {
+        ctx->state[0] = 0x67452301;
+        ctx->state[1] = 0xefcdab89;
+        ctx->state[2] = 0x98badcfe;
+        ctx->state[3] = 0x10325476;
+    }
+    else
+    {
+        ctx->state[0] = 0x6a09e667;
+        ctx->state[1] = 0xbb67ae85;
+        ctx->state[2] = 0x3c6ef372;
+        ctx->state[3] = 0xa54ff53a;
+        ctx->state[4] = 0x510e527f;
+        ctx->state[5] = 0x9b05688c;
+        ctx->state[6] = 0x1f83d9ab;
+        ctx->state[7] = 0x5be0cd19;
+    }
+}
+
+void vtoy_hash_update(vtoy_hash_ctx *ctx, const void *data, size_t len)
+{
+    size_t fill;
+    const uint8_t *buf = (const uint8_t *)data;
+
+    ctx->length += len;
+
+    if (ctx->used > 0)
+    {
+        fill = 64 - ctx->used;
+        if (len < fill)
+        {
+            memcpy(ctx->block + ctx->used, buf, len);
+            ctx->used += (uint32_t)len;
+            return;
+        }
+
+        memcpy(ctx->block + ctx->used, buf, fill);
+        hash_transform(ctx, ctx->block);
+        buf += fill;
+        len -= fill;
+        ctx->used = 0;
+    }
+
+    /* hash whole blocks in place */
+    for (; len >= 64; buf += 64, len -= 64)
+    {
+        hash_transform(ctx, buf);
+    }
+
+    memcpy(ctx->block, buf, len);
+    ctx->used = (uint32_t)len;
+}
+
+int vtoy_hash_final(vtoy_hash_ctx *ctx, uint8_t *digest)
+{
+    int i;
+    uint64_t bits = ctx->length * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56)
+    {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        hash_transform(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+
+    /* message length, little endian for MD5 and big endian for SHA-256 */
+    for (i = 0; i < 8; i++)
+    {
+        if (ctx->type == VTOY_HASH_MD5)
+        {
+            ctx->block[56 + i] = (uint8_t)(bits >> (i * 8));
+        }
+        else
+        {
+            ctx->block[63 - i] = (uint8_t)(bits >> (i * 8));
+        }
+    }
+    hash_transform(ctx, ctx->block);
+
+    if (ctx->type == VTOY_HASH_MD5)
+    {
+        for (i = 0; i < VTOY_MD5_LEN; i++)
+        {
+            digest[i] = (uint8_t)(ctx->state[i / 4] >> ((i % 4) * 8));
+        }
+        return VTOY_MD5_LEN;
+    }
+
+    for (i = 0; i < VTOY_SHA256_LEN; i++)
+    {
+        digest[i] = (uint8_t)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+    }
+    return VTOY_SHA256_LEN;
+}
@@ -0,0 +1,47 @@
+/******************************************************************************
+ * vtoyhash.h  ---- MD5 and SHA-256 used to verify the image
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VTOYHASH_H__
+#define __VTOYHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VTOY_HASH_MD5       0
+#define VTOY_HASH_SHA256    1
+
+#define VTOY_MD5_LEN        16
+#define VTOY_SHA256_LEN     32
+#define VTOY_HASH_MAX_LEN   VTOY_SHA256_LEN
+
+typedef struct vtoy_hash_ctx
+{
+    int       type;         // VTOY_HASH_MD5 or VTOY_HASH_SHA256
+    uint32_t  state[8];
+    uint64_t  length;       // total bytes hashed
+    uint32_t  used;         // bytes pending in block
+    uint8_t   block[64];
+}vtoy_hash_ctx;
+
+void vtoy_hash_init(vtoy_hash_ctx *ctx, int type);
+void vtoy_hash_update(vtoy_hash_ctx *ctx, const void *data, size_t len);
+int vtoy_hash_final(vtoy_hash_ctx *ctx, uint8_t *digest);
+
+#endif
@@ -0,0 +1,272 @@
+/******************************************************************************
+ * vtoyloc.c  ---- Build the image location table from file runs
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <vtoyloc.h>
+
+#define VTOY_MIN(a, b)      ((a) < (b) ? (a) : (b))
+
+uint32_t vtoy_location_len(ventoy_image_location *location)
+{
+    return (uint32_t)(sizeof(ventoy_image_location) + 
+                      sizeof(ventoy_image_disk_region) * (location->region_count - 1));
+}
+
+ventoy_image_location * vtoy_alloc_location(uint32_t maxregion)
+{
+    ventoy_guid guid = VENTOY_GUID;
+    ventoy_image_location *location = NULL;
+
+    location = (ventoy_image_location *)malloc(sizeof(ventoy_image_location) + 
+                                               sizeof(ventoy_image_disk_region) * (maxregion - 1));
+    if (location)
+    {
+        memcpy(&location->guid, &guid, sizeof(ventoy_guid));
+        location->image_sector_size = 2048;
+        location->disk_sector_size = 512;
+        location->region_count = 0;
+    }
+
+    return location;
+}
+
+/*
+ * Append size bytes at partition offset to the location table, merge it
+ * into the last region when they are contiguous on disk.
+ */
+int vtoy_add_region(ventoy_image_location **plocation, uint32_t *maxregion, uint64_t size, uint64_t offset)
+{
+    ventoy_image_location *location = *plocation;
+    ventoy_image_location *newlocation = NULL;
+    ventoy_image_disk_region *last = NULL;
+    ventoy_image_disk_region *cur = NULL;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    if (location->region_count > 0)
+    {
+        last = location->regions + location->region_count - 1;
+        if (last->disk_start_sector + (uint64_t)last->image_sector_count * 4 == offset / 512)
+        {
+            last->image_sector_count += (uint32_t)(size / 2048);
+            return 0;
+        }
+    }
+
+    if (location->region_count == *maxregion)
+    {
+        newlocation = vtoy_alloc_location(*maxregion * 2);
+        if (!newlocation)
+        {
+            return 1;
+        }
+
+        memcpy(newlocation, location, vtoy_location_len(location));
+        free(location);
+        *plocation = location = newlocation;
+        *maxregion *= 2;
+    }
+
+    /* last may be stale after realloc */
+    cur = location->regions + location->region_count;
+    cur->image_start_sector = 0;
+    if (location->region_count > 0)
+    {
+        cur->image_start_sector = (cur - 1)->image_start_sector + (cur - 1)->image_sector_count;
+    }
+    cur->image_sector_count = (uint32_t)(size / 2048);
+    cur->disk_start_sector = offset / 512;
+    location->region_count++;
+
+    return 0;
+}
+
+/*
+ * Append a run, merge it into the last one when both are contiguous in the
+ * file and on disk or both are holes.
+ */
+int vtoy_runlist_add(vtoy_runlist *list, uint64_t logical, uint64_t physical, uint64_t count)
+{
+    vtoy_run *last = NULL;
+    vtoy_run *runs = NULL;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (list->count > 0)
+    {
+        last = list->runs + list->count - 1;
+        if (last->logical + last->count == logical &&
+            ((last->physical == VTOY_RUN_HOLE && physical == VTOY_RUN_HOLE) ||
+             (last->physical != VTOY_RUN_HOLE && last->physical + last->count == physical)))
+        {
+            last->count += count;
+            return 0;
+        }
+    }
+
+    if (list->count == list->max)
+    {
+        runs = (vtoy_run *)realloc(list->runs, sizeof(vtoy_run) * (list->max ? list->max * 2 : 64));
+        if (!runs)
+        {
+            return -ENOMEM;
+        }
+        list->runs = runs;
+        list->max = list->max ? list->max * 2 : 64;
+    }
+
+    last = list->runs + list->count++;
+    last->logical = logical;
+    last->physical = physical;
+    last->count = count;
+
+    return 0;
+}
+
+void vtoy_runlist_free(vtoy_runlist *list)
+{
+    free(list->runs);
+    memset(list, 0, sizeof(vtoy_runlist));
+}
+
+/*
+ * Turn the runs of a file into regions. Runs must cover the file from
+ * the start without holes and all but the last one must be made of whole
+ * 2048 byte sectors. unit is the size in bytes of the run counters.
+ */
+ventoy_image_location * vtoy_runs_to_location(const char *path, const vtoy_runlist *list, uint64_t unit)
+{
+    uint32_t i;
+    uint32_t maxregion = 256;
+    uint64_t left = list->size;
+    uint64_t size;
+    uint64_t next = 0;
+    ventoy_image_location *location = NULL;
+
+    location = vtoy_alloc_location(maxregion);
+    if (!location)
+    {
+        return NULL;
+    }
+
+    for (i = 0; i < list->count && left > 0; i++)
+    {
+        if (list->runs[i].logical != next || list->runs[i].physical == VTOY_RUN_HOLE)
+        {
+            fprintf(stderr, "%s has a hole or unwritten extent at %llu\n", path, (unsigned long long)next);
+            goto fail;
+        }
+
+        size = VTOY_MIN(list->runs[i].count * unit, left);
+        if ((size % 2048) && size < left)
+        {
+            /* regions are counted in 2048 byte sectors */
+            fprintf(stderr, "Run at %llu of %s is not 2048 bytes aligned\n", (unsigned long long)next, path);
+            goto fail;
+        }
+
+        if (vtoy_add_region(&location, &maxregion, size, list->runs[i].physical * unit))
+        {
+            goto fail;
+        }
+
+        left -= size;
+        next += list->runs[i].count;
+    }
+
+    if (left > 0)
+    {
+        fprintf(stderr, "Runs of %s are shorter than the file\n", path);
+        goto fail;
+    }
+
+    return location;
+
+fail:
+    free(location);
+    return NULL;
+}
+
+/* read len bytes at offset of the partition, reads counts the calls for debug */
+int vtoy_pread(int fd, void *buf, size_t len, uint64_t offset, uint32_t *reads)
+{
+    ssize_t ret;
+
+    if (reads)
+    {
+        (*reads)++;
+    }
+
+    ret = pread(fd, buf, len, (off_t)offset);
+    if (ret != (ssize_t)len)
+    {
+        debug("read %lu bytes at %llu failed %d\n", (unsigned long)len, (unsigned long long)offset, errno);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Walk the components of path from directory root, empty components are
+ * skipped. find resolves one component and checks its length.
+ */
+int vtoy_walk_path(void *vol, uint64_t root, const char *path, vtoy_find_child find, uint64_t *ino)
+{
+    int rc;
+    int len;
+    uint64_t cur = root;
+
+    while (*path)
+    {
+        while (*path == '/')
+        {
+            path++;
+        }
+
+        len = (int)strcspn(path, "/");
+        if (len == 0)
+        {
+            break;
+        }
+
+        rc = find(vol, cur, path, len, &cur);
+        if (rc)
+        {
+            return rc;
+        }
+        path += len;
+    }
+
+    *ino = cur;
+    return 0;
+}
@@ -0,0 +1,66 @@
+/******************************************************************************
+ * vtoyloc.h  ---- Build the image location table from file runs
+ *
+ * Copyright (c) 2020, longpanda <admin@ventoy.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __VTOYLOC_H__
+#define __VTOYLOC_H__
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vtoydump.h>
+
+#define VTOY_RUN_HOLE       ((uint64_t)-1)
+
+/* a run of a file in units of fs clusters or blocks */
+typedef struct vtoy_run
+{
+    uint64_t logical;       // first unit in the file
+    uint64_t physical;      // first unit in the partition, VTOY_RUN_HOLE if not allocated
+    uint64_t count;
+}vtoy_run;
+
+/* runs of a file appended by the fs parsers in logical order */
+typedef struct vtoy_runlist
+{
+    vtoy_run *runs;
+    uint32_t count;
+    uint32_t max;
+    uint64_t size;          // file size in bytes
+    uint32_t flags;         // fs specific file flags
+    uint16_t mode;          // file mode, 0 if the fs has none
+    int      resident;      // the data is stored in the metadata (ntfs)
+}vtoy_runlist;
+
+/* find name (namelen bytes, not terminated) in directory dir of the volume */
+typedef int (*vtoy_find_child)(void *vol, uint64_t dir, const char *name, int namelen, uint64_t *child);
+
+ventoy_image_location * vtoy_alloc_location(uint32_t maxregion);
+uint32_t vtoy_location_len(ventoy_image_location *location);
+int vtoy_add_region(ventoy_image_location **plocation, uint32_t *maxregion, uint64_t size, uint64_t offset);
+
+int vtoy_runlist_add(vtoy_runlist *list, uint64_t logical, uint64_t physical, uint64_t count);
+void vtoy_runlist_free(vtoy_runlist *list);
+ventoy_image_location * vtoy_runs_to_location(const char *path, const vtoy_runlist *list, uint64_t unit);
+
+int vtoy_pread(int fd, void *buf, size_t len, uint64_t offset, uint32_t *reads);
+int vtoy_walk_path(void *vol, uint64_t root, const char *path, vtoy_find_child find, uint64_t *ino);
+
+#endif